@@ -1,56 +1,138 @@
+// For syscall(), used to read hardware counters on Linux
+#define _GNU_SOURCE
+
 #include "mpc.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
 #include <editline/readline.h>
 
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <setjmp.h>
+
 // Forward Declarations
 
 struct lval;
 struct lenv;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lcode lcode;
 
 enum { LVAL_ERR, LVAL_NUM,    LVAL_SYM, LVAL_STR,
-       LVAL_FUN, LVAL_SEXPR,  LVAL_QEXPR };
+       LVAL_FUN, LVAL_SEXPR,  LVAL_QEXPR, LVAL_PART };
       
 
 typedef lval* (*lbuiltin)(lenv*, lval*);
 
+// Tagged union, only the payload matching type is valid
 struct lval {
   int type;
-  long num;
-
-  // Error, Symbol and String types
-  char* err;
-  char* sym;
-  char* str;
-
-  // Functions
-  lbuiltin builtin;
-  lenv* env;
-  lval* formals;
-  lval* body;
 
-  // Count and Pointer to list of lval points
-  int count;
-  struct lval** cell;
+  // See LVAL_SHARED, GC_MARKED and GC_REMEMBERED
+  int flags;
+
+  union {
+    // Number
+    long num;
+
+    // Next free slot on the collector's free list, or the new
+    // address of a value promoted out of the nursery
+    lval* next;
+
+    // Error and String types
+    char* err;
+    char* str;
+
+    // Symbol, with the frame slot it was resolved to or -1, and the
+    // root slot it was last found in while the root was at version
+    // stamp, see lenv_get
+    struct {
+      char* sym;
+      int slot;
+      int root;
+      unsigned long stamp;
+    };
+
+    // Functions
+    struct {
+      lbuiltin builtin;
+      lval* formals;
+      lval* body;
+    };
+
+    // Partial application, a lambda and the first arguments it is
+    // called with once enough of them have been given
+    struct {
+      lval* base;
+      lval** args;
+      int nargs;
+    };
+
+    // Count and Pointer to list of lval points, with the bytecode
+    // it was compiled to once evaluated by the VM. A view has no
+    // bytecode, its cells are part of the array of the owner list. A
+    // buffer is an owner with count cells, of which lo to hi are used.
+    // Other lists have room for max cells.
+    struct {
+      int count;
+      int max;
+      struct lval** cell;
+      union {
+        lcode* code;
+        lval* owner;
+        struct { int lo; int hi; };
+      };
+    };
+  };
 };
 
+// Values of the flags field
+#define LVAL_SHARED   1
+#define GC_MARKED     2
+#define GC_REMEMBERED 4
+#define LVAL_MACRO    8
+#define LVAL_VIEW     16
+#define LVAL_BUFFER   32
+
 // Maps the relationship between variable names and values
 struct lenv {
   lenv* par;
   int count;
   char** syms;
   lval** vals;
+  // Hash index into syms for large scopes, see LENV_HASH_MIN
+  int* index;
+  int max;
 };
 
 void lval_print(lval* v);
 lval* lval_eval(lenv* e, lval* v);
-lval* lval_eval_sexpr(lenv* e, lval* v);
+lval* lval_eval_sexpr(lenv* e, lval* v, lenv* frame);
+lval* vm_run(lenv* e, lval* v, lenv* frame);
+lval* lval_callback(lenv* e, lval* f, lval* a);
+void lcode_del(lcode* c);
 lval* lval_join(lval* x, lval* y);
-lval* lval_copy(lval* v);
+lval* lval_concat(lval* x, lval* y);
 void lenv_del(lenv* e);
-lenv* lenv_copy(lenv* e);
 void lval_print_str(lval* v);
-lval* lval_pop(lval* v, int i);
+lval* lval_add(lval* v, lval* x);
+lval* lval_expand(lval* v);
+lval* builtin_if(lenv* e, lval* a);
+lval* builtin_select(lenv* e, lval* a);
+lval* builtin_case(lenv* e, lval* a);
+lval* builtin_let(lenv* e, lval* a);
+typedef struct lopt lopt;
+lopt* lopt_new(lval* forms);
+lval* lval_optimize(lopt* o, lval* v, int form);
+void lopt_del(lopt* o);
 
 // Forward declare parser pointers
 mpc_parser_t* Number; 
@@ -62,9 +144,728 @@ mpc_parser_t* Qexpr;
 mpc_parser_t* Expr; 
 mpc_parser_t* Tyson;
 
+// Small integers (fixnums) live directly in the lval* word with the
+// low bit set, heap lvals are always at least 2 byte aligned.
+#define LVAL_FIXNUM_MIN (LONG_MIN >> 1)
+#define LVAL_FIXNUM_MAX (LONG_MAX >> 1)
+
+static inline int lval_is_fixnum(lval* v) {
+  return ((uintptr_t)v & 1) != 0;
+}
+
+static inline int lval_type(lval* v) {
+  return lval_is_fixnum(v) ? LVAL_NUM : v->type;
+}
+
+static inline long lval_num_value(lval* v) {
+  return lval_is_fixnum(v) ? (long)((intptr_t)v >> 1) : v->num;
+}
+
+// Values start out unshared, only referenced from the argument list
+// they are passed in, and builtins may then update them in place. Once
+// a second reference may exist, by binding the value, capturing it in a
+// function or copying it into another list, the value and everything
+// it contains is marked shared for good and has to be copied on write.
+static inline int lval_shared(lval* v) {
+  return lval_is_fixnum(v) || (v->flags & LVAL_SHARED);
+}
+
+void lval_share(lval* v) {
+  if (lval_shared(v)) { return; }
+  v->flags |= LVAL_SHARED;
+
+  switch (v->type) {
+    case LVAL_FUN:
+      if (!v->builtin) {
+        lval_share(v->formals);
+        lval_share(v->body);
+      }
+    break;
+    case LVAL_PART:
+      lval_share(v->base);
+      for (int i = 0; i < v->nargs; i++) {
+        lval_share(v->args[i]);
+      }
+    break;
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+      for (int i = 0; i < v->count; i++) {
+        lval_share(v->cell[i]);
+      }
+    break;
+  }
+}
+
+// ### ALLOCATION ###
+
+// Build with -DTYSON_SLAB=0 to use the system allocator directly
+#ifndef TYSON_SLAB
+#define TYSON_SLAB 1
+#endif
+
+// Objects are carved out of blocks of this size
+#define SLAB_BLOCK_SIZE 16384
+
+// Pointer arrays up to this many slots come from slabs
+#define SLAB_MAX_CELLS 8
+
+typedef struct slab_node {
+  struct slab_node* next;
+} slab_node;
+
+// A size class with its free list and counters
+typedef struct {
+  char* name;
+  size_t size;
+  slab_node* free;
+  unsigned long allocs;
+  unsigned long frees;
+  unsigned long hits;
+  unsigned long blocks;
+  // Arrays resized to this class, see cell_realloc
+  unsigned long resizes;
+} slab;
+
+// Free lists are per thread so no locking is needed, lvals live in
+// the collector's heap and only use this for their counters
+static _Thread_local slab slab_lval   = { "lval",    sizeof(lval) };
+static _Thread_local slab slab_lenv   = { "lenv",    sizeof(lenv) };
+static _Thread_local slab slab_cells[] = {
+  { "cells/1", 1 * sizeof(void*) },
+  { "cells/2", 2 * sizeof(void*) },
+  { "cells/4", 4 * sizeof(void*) },
+  { "cells/8", 8 * sizeof(void*) },
+};
+// Pointer arrays too large for a slab, counted but served by malloc
+static _Thread_local slab slab_cells_large = { "cells/n" };
+
+void* slab_alloc(slab* s) {
+  s->allocs++;
+#if TYSON_SLAB
+  // Reuse a freed object if there is one
+  if (s->free) {
+    slab_node* n = s->free;
+    s->free = n->next;
+    s->hits++;
+    return n;
+  }
+
+  // Otherwise carve a new block, keep the first object and
+  // push the rest onto the free list
+  char* block = malloc(SLAB_BLOCK_SIZE);
+  size_t n = SLAB_BLOCK_SIZE / s->size;
+  for (size_t i = n - 1; i > 0; i--) {
+    slab_node* node = (slab_node*)(block + i * s->size);
+    node->next = s->free;
+    s->free = node;
+  }
+  s->blocks++;
+  return block;
+#else
+  return malloc(s->size);
+#endif
+}
+
+void slab_free(slab* s, void* p) {
+  s->frees++;
+#if TYSON_SLAB
+  slab_node* n = p;
+  n->next = s->free;
+  s->free = n;
+#else
+  free(p);
+#endif
+}
+
+lenv* lenv_alloc(void) { return slab_alloc(&slab_lenv); }
+void lenv_free(lenv* e) { slab_free(&slab_lenv, e); }
+
+// Size class for an array of n pointers, -1 if too large
+int cell_class(int n) {
+  if (n <= 1) { return 0; }
+  if (n <= 2) { return 1; }
+  if (n <= 4) { return 2; }
+  if (n <= SLAB_MAX_CELLS) { return 3; }
+  return -1;
+}
+
+// Allocate an array of n pointers, NULL when empty
+void* cell_alloc(int n) {
+  if (n == 0) { return NULL; }
+  int c = cell_class(n);
+  if (c >= 0) { return slab_alloc(&slab_cells[c]); }
+  slab_cells_large.allocs++;
+  return malloc(sizeof(void*) * n);
+}
+
+// Free an array that currently holds n pointers
+void cell_free(void* p, int n) {
+  if (p == NULL) { return; }
+  int c = cell_class(n);
+  if (c >= 0) { slab_free(&slab_cells[c], p); return; }
+  slab_cells_large.frees++;
+  free(p);
+}
+
+// Resize an array of pointers from n to m slots
+void* cell_realloc(void* p, int n, int m) {
+  if (m == 0) { cell_free(p, n); return NULL; }
+  if (p == NULL) { return cell_alloc(m); }
+
+  int cn = cell_class(n);
+  int cm = cell_class(m);
+
+  // Still fits the same size class, nothing to do
+  if (cn >= 0 && cn == cm) { return p; }
+
+  // Both too large for the slabs, let realloc handle it
+  if (cn < 0 && cm < 0) {
+    slab_cells_large.resizes++;
+    return realloc(p, sizeof(void*) * m);
+  }
+
+  // Moving between classes, copy over
+  if (cm >= 0) { slab_cells[cm].resizes++; } else { slab_cells_large.resizes++; }
+  void* q = cell_alloc(m);
+  memcpy(q, p, sizeof(void*) * (n < m ? n : m));
+  cell_free(p, n);
+  return q;
+}
+
+void slab_print(slab* s) {
+  fprintf(stderr, "%-8s %10lu %10lu %10lu %6.1f%% %6lu %10lu\n",
+    s->name, s->allocs, s->frees, s->hits,
+    s->allocs ? 100.0 * s->hits / s->allocs : 0.0, s->blocks, s->resizes);
+}
+
+// ### SYMBOLS ###
+
+// Every symbol name is interned once in this table and never freed, so
+// the interned pointer identifies the symbol and two symbols are equal
+// exactly when their pointers are. Open addressing, linear probing.
+
+// Interned names are stored inline after their counters
+typedef struct {
+  // Number of bindings of the symbol outside the root environment
+  long frames;
+  char name[];
+} sym_entry;
+
+static inline sym_entry* sym_entry_of(char* sym) {
+  return (sym_entry*)(sym - offsetof(sym_entry, name));
+}
+
+typedef struct {
+  char** names;
+  int count;
+  int max;
+} sym_table;
+
+sym_table syms = { NULL, 0, 0 };
+
+// Interned symbols the evaluator checks for
+char* sym_amp;
+char* sym_if;
+char* sym_lambda;
+char* sym_put;
+char* sym_def;
+char* sym_fun;
+char* sym_defmacro;
+
+unsigned long sym_hash(char* s) {
+  // FNV-1a
+  unsigned long h = 2166136261u;
+  while (*s) { h = (h ^ (unsigned char)*s++) * 16777619u; }
+  return h;
+}
+
+char* sym_intern(char* s) {
+  // Grow to keep the table at most half full
+  if (2 * (syms.count + 1) > syms.max) {
+    int max = syms.max ? syms.max * 2 : 256;
+    char** names = calloc(max, sizeof(char*));
+    for (int i = 0; i < syms.max; i++) {
+      if (!syms.names[i]) { continue; }
+      unsigned long j = sym_hash(syms.names[i]) & (max - 1);
+      while (names[j]) { j = (j + 1) & (max - 1); }
+      names[j] = syms.names[i];
+    }
+    free(syms.names);
+    syms.names = names;
+    syms.max = max;
+  }
+
+  // Find the name or the empty slot where it goes
+  unsigned long i = sym_hash(s) & (syms.max - 1);
+  while (syms.names[i]) {
+    if (strcmp(syms.names[i], s) == 0) { return syms.names[i]; }
+    i = (i + 1) & (syms.max - 1);
+  }
+
+  sym_entry* n = malloc(sizeof(sym_entry) + strlen(s) + 1);
+  n->frames = 0;
+  strcpy(n->name, s);
+  syms.names[i] = n->name;
+  syms.count++;
+  return syms.names[i];
+}
+
+// ### GARBAGE COLLECTION ###
+
+// Heap lvals are owned by a generational collector. Values are shared
+// by pointer and never modified once reachable from an environment or
+// from another value, so they are never copied.
+//
+// New values are bump allocated in the nursery. A minor collection
+// copies the ones still reachable into the old space and resets the
+// nursery, a major collection marks and sweeps the old space, which is
+// made of blocks of lval slots with a free list. Old values that may
+// point into the nursery are kept in the remembered set.
+//
+// Collection only happens at gc_maybe() safe points in the evaluator.
+// Since values move, every lval* local that is used after a call to
+// lval_eval must be registered with GC_ROOT, and every environment in
+// use with gc_push_env. Environments are not collected, they are freed
+// by the call that created them or by the function value that owns them.
+
+// Marks an lval slot on the old space free list
+#define LVAL_FREE -1
+
+// Marks a nursery lval that was promoted, next holds its new address
+#define LVAL_FWD -2
+
+// Number of lvals in each old space block
+#define GC_BLOCK_LVALS (SLAB_BLOCK_SIZE / sizeof(lval))
+
+// Old space allocations between major collections, at least
+#ifndef GC_MIN_THRESHOLD
+#define GC_MIN_THRESHOLD 65536
+#endif
+
+// Default nursery size in kilobytes, see --nursery
+#define GC_NURSERY_KB 256
+
+// Pause statistics of one kind of collection
+typedef struct {
+  unsigned long count;
+  double total;
+  double max;
+} gc_pauses;
+
+typedef struct {
+  // Nursery, allocation bumps top until it reaches end
+  lval* nursery;
+  lval* top;
+  lval* end;
+
+  // Old space
+  lval** blocks;
+  int nblocks;
+  lval* free;
+  unsigned long since;
+  unsigned long threshold;
+  unsigned long live;
+
+  // Statistics
+  unsigned long promoted;
+  gc_pauses minor;
+  gc_pauses major;
+} gc_heap;
+
+gc_heap gc = { NULL, NULL, NULL, NULL, 0, NULL, 0, GC_MIN_THRESHOLD };
+
+// A growable stack of lval pointers
+typedef struct {
+  lval** items;
+  int count;
+  int max;
+} gc_stack;
+
+// Old values that may point into the nursery
+gc_stack gc_remembered = { NULL, 0, 0 };
+
+// Promoted values whose children still have to be promoted
+gc_stack gc_grey = { NULL, 0, 0 };
+
+// Operand stack of the bytecode VM
+gc_stack vm_stack = { NULL, 0, 0 };
+
+void gc_stack_push(gc_stack* s, lval* v) {
+  if (s->count == s->max) {
+    s->max = s->max ? s->max * 2 : 256;
+    s->items = realloc(s->items, sizeof(lval*) * s->max);
+  }
+  s->items[s->count++] = v;
+}
+
+// Addresses of lval* locals live across a safe point
+lval*** gc_roots = NULL;
+int gc_nroots = 0;
+int gc_maxroots = 0;
+
+// Environments in use, the global one at the bottom
+lenv** gc_envs = NULL;
+int gc_nenvs = 0;
+int gc_maxenvs = 0;
+
+void gc_root(lval** r) {
+  if (gc_nroots == gc_maxroots) {
+    gc_maxroots = gc_maxroots ? gc_maxroots * 2 : 256;
+    gc_roots = realloc(gc_roots, sizeof(lval**) * gc_maxroots);
+  }
+  gc_roots[gc_nroots++] = r;
+}
+
+void gc_push_env(lenv* e) {
+  if (gc_nenvs == gc_maxenvs) {
+    gc_maxenvs = gc_maxenvs ? gc_maxenvs * 2 : 64;
+    gc_envs = realloc(gc_envs, sizeof(lenv*) * gc_maxenvs);
+  }
+  gc_envs[gc_nenvs++] = e;
+}
+
+void gc_pop_env(void) {
+  gc_nenvs--;
+}
+
+#define GC_ROOT(v) gc_root(&(v))
+
+// Remember the root stack on entry and restore it on every return
+#define GC_FRAME int gc_frame = gc_nroots
+#define GC_RETURN(x) do { \
+  lval* gc_ret = (x); \
+  gc_nroots = gc_frame; \
+  return gc_ret; \
+  } while (0)
+
+void gc_init(size_t nursery_kb) {
+  size_t n = nursery_kb * 1024 / sizeof(lval);
+  if (n == 0) { n = 1; }
+  gc.nursery = malloc(n * sizeof(lval));
+  gc.top = gc.nursery;
+  gc.end = gc.nursery + n;
+}
+
+static inline int gc_in_nursery(lval* v) {
+  return !lval_is_fixnum(v) && v >= gc.nursery && v < gc.end;
+}
+
+void gc_remember(lval* v) {
+  if (v->flags & GC_REMEMBERED) { return; }
+  v->flags |= GC_REMEMBERED;
+  gc_stack_push(&gc_remembered, v);
+}
+
+// Must be called when x is stored into the already allocated value v
+static inline void gc_write_barrier(lval* v, lval* x) {
+  if (gc_in_nursery(x) && !gc_in_nursery(v)) { gc_remember(v); }
+}
+
+void gc_grow(void) {
+  lval* block = malloc(GC_BLOCK_LVALS * sizeof(lval));
+  for (int i = GC_BLOCK_LVALS - 1; i >= 0; i--) {
+    block[i].type = LVAL_FREE;
+    block[i].next = gc.free;
+    gc.free = &block[i];
+  }
+  gc.nblocks++;
+  gc.blocks = realloc(gc.blocks, sizeof(lval*) * gc.nblocks);
+  gc.blocks[gc.nblocks-1] = block;
+  slab_lval.blocks++;
+}
+
+lval* gc_old_alloc(void) {
+  gc.since++;
+  if (!gc.free) { gc_grow(); }
+  lval* v = gc.free;
+  gc.free = v->next;
+  v->flags = 0;
+  return v;
+}
+
+lval* lval_alloc(void) {
+  slab_lval.allocs++;
+
+  // Bump allocate in the nursery
+  if (gc.top < gc.end) {
+    slab_lval.hits++;
+    lval* v = gc.top++;
+    v->flags = 0;
+    return v;
+  }
+
+  // Nursery is full but this is no safe point, allocate old and
+  // remember it since it will be filled with young values. Only a
+  // reused free slot counts as a hit.
+  if (gc.free) { slab_lval.hits++; }
+  lval* v = gc_old_alloc();
+  gc_remember(v);
+  return v;
+}
+
+// Release what an unreachable lval owns, its children are collected
+// on their own
+void lval_finalize(lval* v) {
+  switch (v->type) {
+    case LVAL_NUM: break;
+    case LVAL_FUN: break;
+    case LVAL_PART: cell_free(v->args, v->nargs); break;
+    case LVAL_ERR: free(v->err); break;
+    case LVAL_STR: free(v->str); break;
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+      if (v->flags & LVAL_VIEW) { break; }
+      if (v->flags & LVAL_BUFFER) { cell_free(v->cell, v->count); break; }
+      cell_free(v->cell, v->max);
+      if (v->code) { lcode_del(v->code); }
+    break;
+  }
+}
+
+double gc_now(void) {
+  struct timespec t;
+  timespec_get(&t, TIME_UTC);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+void gc_pause(gc_pauses* p, double start) {
+  double t = gc_now() - start;
+  p->count++;
+  p->total += t;
+  if (t > p->max) { p->max = t; }
+}
+
+// Move a nursery value pointed to by slot into the old space
+void gc_promote(lval** slot) {
+  lval* v = *slot;
+  if (!gc_in_nursery(v)) { return; }
+
+  // Already moved, follow the forwarding address
+  if (v->type == LVAL_FWD) {
+    *slot = v->next;
+    return;
+  }
+
+  lval* n = gc_old_alloc();
+  *n = *v;
+  n->flags = v->flags & (LVAL_SHARED | LVAL_MACRO | LVAL_VIEW | LVAL_BUFFER);
+  v->type = LVAL_FWD;
+  v->next = n;
+  *slot = n;
+  gc.promoted++;
+
+  // Its children are promoted later
+  gc_stack_push(&gc_grey, n);
+}
+
+void gc_promote_code(lcode* c);
+
+// Promote everything an old value points to
+void gc_promote_children(lval* v) {
+  switch (v->type) {
+    case LVAL_FUN:
+      if (!v->builtin) {
+        gc_promote(&v->formals);
+        gc_promote(&v->body);
+      }
+    break;
+    case LVAL_PART:
+      gc_promote(&v->base);
+      for (int i = 0; i < v->nargs; i++) {
+        gc_promote(&v->args[i]);
+      }
+    break;
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+      // The cells of a view are promoted with its owner
+      if (v->flags & LVAL_VIEW) {
+        gc_promote(&v->owner);
+        break;
+      }
+      if (v->flags & LVAL_BUFFER) {
+        for (int i = v->lo; i < v->hi; i++) {
+          gc_promote(&v->cell[i]);
+        }
+        break;
+      }
+      for (int i = 0; i < v->count; i++) {
+        gc_promote(&v->cell[i]);
+      }
+      if (v->code) { gc_promote_code(v->code); }
+    break;
+  }
+}
+
+void gc_minor(void) {
+  double start = gc_now();
+
+  // Promote what the roots point to
+  for (int i = 0; i < gc_nroots; i++) {
+    if (*gc_roots[i]) { gc_promote(gc_roots[i]); }
+  }
+  for (int i = 0; i < gc_nenvs; i++) {
+    for (int j = 0; j < gc_envs[i]->count; j++) {
+      gc_promote(&gc_envs[i]->vals[j]);
+    }
+  }
+
+  // And what old values point to
+  for (int i = 0; i < gc_remembered.count; i++) {
+    lval* v = gc_remembered.items[i];
+    v->flags &= ~GC_REMEMBERED;
+    gc_promote_children(v);
+  }
+  gc_remembered.count = 0;
+
+  // The VM's operand stack
+  for (int i = 0; i < vm_stack.count; i++) {
+    gc_promote(&vm_stack.items[i]);
+  }
+
+  // Then everything reachable from promoted values
+  while (gc_grey.count) {
+    gc_promote_children(gc_grey.items[--gc_grey.count]);
+  }
+
+  // Whatever was not promoted is dead
+  for (lval* v = gc.nursery; v < gc.top; v++) {
+    if (v->type != LVAL_FWD) {
+      lval_finalize(v);
+      slab_lval.frees++;
+    }
+  }
+  gc.top = gc.nursery;
+
+  gc_pause(&gc.minor, start);
+}
+
+void gc_mark(lval* v) {
+  if (lval_is_fixnum(v) || (v->flags & GC_MARKED)) { return; }
+  v->flags |= GC_MARKED;
+
+  switch (v->type) {
+    case LVAL_FUN:
+      if (!v->builtin) {
+        gc_mark(v->formals);
+        gc_mark(v->body);
+      }
+    break;
+    case LVAL_PART:
+      gc_mark(v->base);
+      for (int i = 0; i < v->nargs; i++) {
+        gc_mark(v->args[i]);
+      }
+    break;
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+      if (v->flags & LVAL_VIEW) {
+        gc_mark(v->owner);
+        break;
+      }
+      if (v->flags & LVAL_BUFFER) {
+        for (int i = v->lo; i < v->hi; i++) {
+          gc_mark(v->cell[i]);
+        }
+        break;
+      }
+      for (int i = 0; i < v->count; i++) {
+        gc_mark(v->cell[i]);
+      }
+    break;
+  }
+}
+
+void gc_sweep(void) {
+  gc.live = 0;
+  for (int b = 0; b < gc.nblocks; b++) {
+    for (int i = 0; i < GC_BLOCK_LVALS; i++) {
+      lval* v = &gc.blocks[b][i];
+      if (v->type == LVAL_FREE) { continue; }
+
+      // Survivor, clear the mark for next time
+      if (v->flags & GC_MARKED) {
+        v->flags &= ~GC_MARKED;
+        gc.live++;
+        continue;
+      }
+
+      // Unreachable, release and put back on the free list
+      lval_finalize(v);
+      v->type = LVAL_FREE;
+      v->next = gc.free;
+      gc.free = v;
+      slab_lval.frees++;
+    }
+  }
+}
+
+void gc_major(void) {
+  // Empty the nursery first so only the old space has to be traced
+  gc_minor();
+
+  double start = gc_now();
+
+  // Mark everything reachable from the roots
+  for (int i = 0; i < gc_nroots; i++) {
+    if (*gc_roots[i]) { gc_mark(*gc_roots[i]); }
+  }
+  for (int i = 0; i < gc_nenvs; i++) {
+    for (int j = 0; j < gc_envs[i]->count; j++) {
+      gc_mark(gc_envs[i]->vals[j]);
+    }
+  }
+  for (int i = 0; i < vm_stack.count; i++) {
+    gc_mark(vm_stack.items[i]);
+  }
+
+  gc_sweep();
+
+  // Let the old space grow with the amount of live data
+  gc.threshold = gc.live * 2 > GC_MIN_THRESHOLD ? gc.live * 2 : GC_MIN_THRESHOLD;
+  gc.since = 0;
+
+  gc_pause(&gc.major, start);
+}
+
+// Safe point, collect if the nursery is full or enough was promoted
+// since the last major collection
+void gc_maybe(void) {
+  if (gc.since >= gc.threshold) {
+    gc_major();
+  } else if (gc.top == gc.end) {
+    gc_minor();
+  }
+}
+
+void gc_pauses_print(char* name, gc_pauses* p) {
+  fprintf(stderr, "%-6s %8lu %10.3f %10.4f %10.4f\n", name, p->count,
+    p->total * 1e3, p->count ? p->total * 1e3 / p->count : 0.0, p->max * 1e3);
+}
+
+void gc_stats_print(void) {
+  fprintf(stderr, "nursery %.0f KB, %lu lvals promoted, %d old space blocks\n",
+    (gc.end - gc.nursery) * sizeof(lval) / 1024.0, gc.promoted, gc.nblocks);
+  fprintf(stderr, "%-6s %8s %10s %10s %10s\n",
+    "pause", "count", "total ms", "avg ms", "max ms");
+  gc_pauses_print("minor", &gc.minor);
+  gc_pauses_print("major", &gc.major);
+}
+
+void alloc_stats_print(void) {
+  fprintf(stderr, "%-8s %10s %10s %10s %7s %6s %10s\n",
+    "class", "allocs", "frees", "hits", "hit", "blocks", "resizes");
+  slab_print(&slab_lval);
+  slab_print(&slab_lenv);
+  for (int i = 0; i < 4; i++) {
+    slab_print(&slab_cells[i]);
+  }
+  slab_print(&slab_cells_large);
+}
+
 char* ltype_name(int t) {
   switch(t) {
-    case LVAL_FUN: return "Function";
+    case LVAL_FUN:
+    case LVAL_PART: return "Function";
     case LVAL_NUM: return "Number";
     case LVAL_ERR: return "Error";
     case LVAL_SYM: return "Symbol";
@@ -76,14 +877,20 @@ char* ltype_name(int t) {
 }
 
 lval* lval_num(long x) {
-  lval* v = malloc(sizeof(lval));
+  // Encode as fixnum when it fits, no allocation needed
+  if (x >= LVAL_FIXNUM_MIN && x <= LVAL_FIXNUM_MAX) {
+    return (lval*)(((uintptr_t)x << 1) | 1);
+  }
+
+  // Otherwise box the number
+  lval* v = lval_alloc();
   v->type = LVAL_NUM;
   v->num = x;
   return v;
 }
 
 lval* lval_err(char* fmt, ...) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc();
   v->type = LVAL_ERR;
 
   // Create and initialize a variable(va) list
@@ -106,15 +913,17 @@ lval* lval_err(char* fmt, ...) {
 }
 
 lval* lval_sym(char* s) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc();
   v->type = LVAL_SYM;
-  v->sym = malloc(strlen(s) + 1);
-  strcpy(v->sym, s);
+  v->sym = sym_intern(s);
+  v->slot = -1;
+  v->root = 0;
+  v->stamp = 0;
   return v;
 }
 
 lval* lval_str(char* s) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc();
   v->type = LVAL_STR;
   v->str = malloc(strlen(s) + 1);
   strcpy(v->str, s);
@@ -122,139 +931,243 @@ lval* lval_str(char* s) {
 }
 
 lval* lval_sexpr(void) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc();
   v->type = LVAL_SEXPR;
   v->count = 0;
+  v->max = 0;
   v->cell = NULL;
+  v->code = NULL;
   return v;
 }
 
 // A pointer to a new empty Qexpr lval
 lval* lval_qexpr(void) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc();
   v->type = LVAL_QEXPR;
   v->count = 0;
+  v->max = 0;
   v->cell = NULL;
+  v->code = NULL;
   return v;
 }
 
 // lval function constructor
 lval* lval_fun(lbuiltin func) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc();
   v->type = LVAL_FUN;
   v->builtin = func;
+  v->formals = NULL;
+  v->body = NULL;
   return v;
 }
 
 
+// The global environment every evaluation chain ends in
+lenv* lenv_root = NULL;
+
+// Changed by every binding made in the root, for the slots cached in
+// symbols to be found again
+unsigned long lenv_root_version = 1;
+
 lenv* lenv_new(void) {
-  lenv* e = malloc(sizeof(lenv));
+  lenv* e = lenv_alloc();
   e->par = NULL;
   e->count = 0;
   e->syms = NULL;
   e->vals = NULL;
+  e->index = NULL;
+  e->max = 0;
   return e;
 }
 
+// The count cells of list l from start on, as a view sharing them
+lval* lval_view(lval* l, int start, int count) {
+  if (count == 0) { return lval_qexpr(); }
+
+  // The cells of a shared list are never changed or freed while it
+  // can be reached
+  lval_share(l);
+  lval* v = lval_alloc();
+  v->type = l->type;
+  v->flags = LVAL_SHARED | LVAL_VIEW;
+  v->count = count;
+  v->cell = l->cell + start;
+  v->owner = (l->flags & LVAL_VIEW) ? l->owner : l;
+  return v;
+}
+
+// Give a view an array of cells of its own
+void lval_unview(lval* v) {
+  if (!(v->flags & LVAL_VIEW)) { return; }
+  lval** cell = cell_alloc(v->count);
+  memcpy(cell, v->cell, sizeof(lval*) * v->count);
+  v->cell = cell;
+  v->max = v->count;
+  v->code = NULL;
+  v->flags &= ~LVAL_VIEW;
+  for (int i = 0; i < v->count; i++) {
+    gc_write_barrier(v, cell[i]);
+  }
+}
+
 lval* lval_lambda(lval* formals, lval* body) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc();
   v->type = LVAL_FUN;
 
   // Set builtin to Null
   v->builtin = NULL;
 
-  // Build new enviroment
-  v->env = lenv_new();
-
-  // Set Formals and Body
+  // Set Formals and Body, they outlive every call. The body caches
+  // its bytecode so it cannot be a view.
+  lval_unview(body);
   v->formals = formals;
   v->body = body;
+  lval_share(v);
   return v;
 }
 
-lval* lenv_get(lenv* e, lval* k) {
-  // Iterate over all items in enviornment
-  for (int i = 0; i < e->count; i++)
-  {
-    // Check for matching variable
-    if (strcmp(e->syms[i], k->sym) == 0) {
-      return lval_copy(e->vals[i]);
-    }
+// Lambda f applied to the n arguments of bound followed by m of args
+lval* lval_part(lval* f, lval** bound, int n, lval** args, int m) {
+  lval* v = lval_alloc();
+  v->type = LVAL_PART;
+  v->base = f;
+  v->nargs = n + m;
+  v->args = cell_alloc(n + m);
+  for (int i = 0; i < n; i++) { v->args[i] = bound[i]; }
+  for (int i = 0; i < m; i++) { v->args[n + i] = args[i]; }
+
+  // Arguments outlive the call they were given to
+  lval_share(v);
+  return v;
+}
+
+// Scopes with at least this many bindings, like the global one, get a
+// hash index. Function frames stay small and are scanned linearly.
+#define LENV_HASH_MIN 16
+
+static inline unsigned long lenv_hash(char* sym) {
+  // Symbols are interned, hash the address, taking the high bits of
+  // the product so nearby addresses spread out
+  return (unsigned long)(((uint64_t)(uintptr_t)sym * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+// Add binding i to the index, which holds i+1 or 0 for empty slots
+void lenv_index_add(lenv* e, int i) {
+  unsigned long j = lenv_hash(e->syms[i]) & (e->max - 1);
+  while (e->index[j]) { j = (j + 1) & (e->max - 1); }
+  e->index[j] = i + 1;
+}
+
+// Rebuild the index with room for the bindings, keeping it at most
+// half full
+void lenv_reindex(lenv* e) {
+  free(e->index);
+  e->max = e->max ? e->max * 2 : 2 * LENV_HASH_MIN;
+  while (2 * e->count > e->max) { e->max *= 2; }
+  e->index = calloc(e->max, sizeof(int));
+  for (int i = 0; i < e->count; i++) {
+    lenv_index_add(e, i);
   }
-  
-  // Check parent enviornment
-  if(e->par) {
-    return lenv_get(e->par, k);
-  } else {
-    // If no matching variable return error
-    return lval_err("Unbound symbol '%s'!", k->sym);
+}
+
+int lenv_find_hashed(lenv* e, char* sym) {
+  unsigned long j = lenv_hash(sym) & (e->max - 1);
+  while (e->index[j]) {
+    int i = e->index[j] - 1;
+    if (e->syms[i] == sym) { return i; }
+    j = (j + 1) & (e->max - 1);
   }
+  return -1;
 }
 
-lenv* lenv_copy(lenv* e) {
-  lenv* n = malloc(sizeof(lenv));
-  n->par = e->par;
-  n->count = e->count;
-  n->syms = malloc(sizeof(char*) * n->count);
-  n->vals = malloc(sizeof(lval*) * n->count);
+// Position of a binding in this scope only, or -1
+static inline int lenv_find(lenv* e, char* sym) {
+  if (e->index) { return lenv_find_hashed(e, sym); }
+
   for (int i = 0; i < e->count; i++) {
-    n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-    strcpy(n->syms[i], e->syms[i]);
-    n->vals[i] = lval_copy(e->vals[i]);
+    if (e->syms[i] == sym) { return i; }
   }
-  return n;
+  return -1;
 }
 
-void lval_del(lval* v) {
+lval* lenv_get(lenv* e, lval* k) {
+  // Symbols resolved by builtin_lambda name a slot of the frame they
+  // are evaluated in. The hint is checked, since the same symbol can be
+  // evaluated elsewhere, and it is only a shortcut for the search below.
+  if (k->slot >= 0 && k->slot < e->count && e->syms[k->slot] == k->sym) {
+    return e->vals[k->slot];
+  }
 
-  switch (v->type) {
-    // Nothing special for Numbers
-    case LVAL_NUM: break;
-    case LVAL_FUN: 
-      if (!v->builtin) {
-        lenv_del(v->env);
-        lval_del(v->formals);
-        lval_del(v->body);
-      }
-    break;
+  // Bound nowhere but the root, skip the frames in between. Each symbol
+  // caches where it was found, so calls to globals skip the search
+  // until the root changes.
+  if (sym_entry_of(k->sym)->frames == 0) {
+    if (k->stamp == lenv_root_version) { return lenv_root->vals[k->root]; }
+    int i = lenv_find(lenv_root, k->sym);
+    if (i >= 0) {
+      k->root = i;
+      k->stamp = lenv_root_version;
+      return lenv_root->vals[i];
+    }
+    e = NULL;
+  }
 
-    // Err, Sym and Str free string data
-    case LVAL_ERR: free(v->err); break;
-    case LVAL_SYM: free(v->sym); break;
-    case LVAL_STR: free(v->str); break;
-
-    // Sexpr and Qexpr delete all elements inside
-    case LVAL_QEXPR:
-    case LVAL_SEXPR:
-      for (int i = 0; i < v->count; i++) {
-        lval_del(v->cell[i]);
-      }
-      // free momeory for pointers
-      free(v->cell);
-    break;
+  // Check this and then each parent enviornment for matching variable
+  for (; e; e = e->par) {
+    int i = lenv_find(e, k->sym);
+    if (i >= 0) {
+      return e->vals[i];
+    }
   }
-  
-  free(v);
+
+  // If no matching variable return error
+  return lval_err("Unbound symbol '%s'!", k->sym);
 }
 
+void lenv_bind(lenv* e, char* sym, lval* v);
+
 void lenv_put(lenv* e, lval* k, lval* v) {
-  // Iterate over all variables in environment
-  // to check if variable already exists
-  for (int i = 0; i < e->count; i++) {
-    // If variable is found, replace the value with new
-    if (strcmp(e->syms[i], k->sym) == 0) {
-      lval_del(e->vals[i]);
-      e->vals[i] = lval_copy(v);
-      return;
-    }
+  // Bound values can be reached again through the symbol
+  lval_share(v);
+  if (e == lenv_root) { lenv_root_version++; }
+
+  // If variable is found, replace the value with new
+  int i = lenv_find(e, k->sym);
+  if (i >= 0) {
+    e->vals[i] = v;
+    return;
   }
   // If no existing variable was found allocate space for new
+  lenv_bind(e, k->sym, v);
+}
+
+// Add a binding for a symbol not yet bound in e
+void lenv_bind(lenv* e, char* sym, lval* v) {
   e->count++;
-  e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-  e->syms = realloc(e->syms, sizeof(char*) * e->count);  
-  e->vals[e->count-1] = lval_copy(v);
-  e->syms[e->count-1] = malloc(strlen(k->sym)+1);
-  strcpy(e->syms[e->count-1], k->sym);
+  e->vals = cell_realloc(e->vals, e->count-1, e->count);
+  e->syms = cell_realloc(e->syms, e->count-1, e->count);
+  e->vals[e->count-1] = v;
+  e->syms[e->count-1] = sym;
+  if (e != lenv_root) { sym_entry_of(sym)->frames++; }
+
+  // Index the new binding
+  if (e->index && 2 * e->count <= e->max) {
+    lenv_index_add(e, e->count-1);
+  } else if (e->count >= LENV_HASH_MIN) {
+    lenv_reindex(e);
+  }
+}
+
+// Move the bindings of a finished frame into the frame of the call it
+// made in tail position, which takes its place in the chain. Bindings
+// the new frame shadows are dropped, so lookups find the same values.
+void lenv_absorb(lenv* e, lenv* from) {
+  for (int i = 0; i < from->count; i++) {
+    if (lenv_find(e, from->syms[i]) < 0) {
+      lenv_bind(e, from->syms[i], from->vals[i]);
+    }
+  }
+  e->par = from->par;
 }
 
 void lenv_def(lenv* e, lval* k, lval* v) {
@@ -266,14 +1179,18 @@ void lenv_def(lenv* e, lval* k, lval* v) {
   lenv_put(e, k, v);
 }
 
+// Free an environment, the values are left to the collector and
+// the names are interned
 void lenv_del(lenv* e) {
-  for (int i = 0; i < e->count; i++) {
-    free(e->syms[i]);
-    lval_del(e->vals[i]);
+  if (e != lenv_root) {
+    for (int i = 0; i < e->count; i++) {
+      sym_entry_of(e->syms[i])->frames--;
+    }
   }
-  free(e->syms);
-  free(e->vals);
-  free(e);
+  cell_free(e->syms, e->count);
+  cell_free(e->vals, e->count);
+  free(e->index);
+  lenv_free(e);
 }
 
 lval* lval_read_num(mpc_ast_t* t) {
@@ -287,10 +1204,30 @@ lval* lval_read_num(mpc_ast_t* t) {
   }
 }
 
+// Make room for n cells in list v. Room grows to twice what it was,
+// so adding cells one at a time reallocates O(log n) times.
+void lval_reserve(lval* v, int n) {
+  if (n <= v->max) { return; }
+  int max = v->max ? v->max * 2 : 1;
+  while (max < n) { max *= 2; }
+  v->cell = cell_realloc(v->cell, v->max, max);
+  v->max = max;
+}
+
+// Give back the room of list v once it uses a quarter of it or less,
+// halving it so removing cells one at a time reallocates rarely
+void lval_shrink(lval* v) {
+  int max = v->max;
+  while (max > SLAB_MAX_CELLS && v->count <= max / 4) { max /= 2; }
+  if (max == v->max) { return; }
+  v->cell = cell_realloc(v->cell, v->max, max);
+  v->max = max;
+}
+
 lval* lval_add(lval* v, lval* x) {
-  v->count++;
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-  v->cell[v->count-1] = x;
+  lval_reserve(v, v->count + 1);
+  v->cell[v->count++] = x;
+  gc_write_barrier(v, x);
   return v;
 }
 
@@ -325,6 +1262,9 @@ lval* lval_read(mpc_ast_t* t) {
   if (strcmp(t->tag, ">") == 0) { x = lval_sexpr(); } 
   if (strstr(t->tag, "sexpr"))  { x = lval_sexpr(); }
   if (strstr(t->tag, "qexpr"))  { x = lval_qexpr(); }
+
+  // Room for every child, brackets and comments included
+  lval_reserve(x, t->children_num);
   
   // Fill list with valid experssion constained within
   for (int i = 0; i < t->children_num; i++) {
@@ -368,9 +1308,9 @@ void lval_print_str(lval* v) {
 }
 
 void lval_print(lval* v) {
-  switch(v->type) {
+  switch(lval_type(v)) {
     case LVAL_ERR:    printf("Error: %s", v->err);  break;
-    case LVAL_NUM:    printf("%li", v->num);  break;
+    case LVAL_NUM:    printf("%li", lval_num_value(v));  break;
     case LVAL_FUN:
       if (v->builtin) {
         printf("<builtin>");
@@ -382,6 +1322,17 @@ void lval_print(lval* v) {
         putchar(')');
       }
     break;
+    case LVAL_PART:
+      // Printed as the lambda taking the formals still to be given
+      printf("(\\ {");
+      for (int i = v->nargs; i < v->base->formals->count; i++) {
+        lval_print(v->base->formals->cell[i]);
+        if (i != v->base->formals->count - 1) { putchar(' '); }
+      }
+      printf("} ");
+      lval_print(v->base->body);
+      putchar(')');
+    break;
     case LVAL_SYM:    printf("%s", v->sym);  break;
     case LVAL_STR:   lval_print_str(v); break;
     case LVAL_SEXPR:  lval_expr_print(v, '(', ')');  break;
@@ -405,48 +1356,74 @@ int number_of_nodes(mpc_ast_t* t){
 }
 
 
-lval* lval_pop(lval* v, int i) { 
-  // Find the item at i
-  lval* x = v->cell[i];
-
-  // Shift memory after "i"
-  memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count-i-1));
-
-  // Update list count
-  v->count--;
-
-  // Reallocate the memory used
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-  return x;
-}
-
-lval* lval_take(lval* v, int i) {
-  lval* x = lval_pop(v, i);
-  lval_del(v);
-  return x;
-}
-
 #define LASSERT(args, cond, fmt, ...) \
   if(!(cond)) { \
-  lval* err = lval_err(fmt, ##__VA_ARGS__); \
-  lval_del(args); \
-  return err; \
+  return lval_err(fmt, ##__VA_ARGS__); \
   }
 
 #define LASSERT_TYPE(func, args, index, expect) \
-  LASSERT(args, args->cell[index]->type == expect, \
+  LASSERT(args, lval_type(args->cell[index]) == expect, \
   "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.", \
-  func, index, ltype_name(args->cell[index]->type), ltype_name(expect))
+  func, index, ltype_name(lval_type(args->cell[index])), ltype_name(expect))
 
 #define LASSERT_NUM(func, args, num) \
   LASSERT(args, args->count == num, \
   "Function '%s' passed incorrect number of arguments. Got %i, Expected %i.", \
   func, args->count, num)
 
+#define LASSERT_FUN(func, args, index) \
+  LASSERT(args, lval_type(args->cell[index]) == LVAL_FUN || \
+    lval_type(args->cell[index]) == LVAL_PART, \
+  "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.", \
+  func, index, ltype_name(lval_type(args->cell[index])), ltype_name(LVAL_FUN))
+
 #define LASSERT_NOT_EMPTY(func, args, index) \
   LASSERT(args, args->cell[index]->count != 0, \
   "Function '%s' passed {} for argument %i.", func, index)
 
+// Expressions in tail position are not evaluated by the builtin or
+// call that reaches them. They are handed back to the lval_eval_sexpr
+// loop that made the call, which carries on with them, so loops run
+// in constant C stack.
+typedef struct {
+  lenv* env;
+  lval* expr;
+  // Whether env is a new call frame that is now the loop's to free
+  int frame;
+} ltail;
+
+ltail tail;
+
+// Stands in for the result of a call ending in a tail call
+lval tail_call;
+
+lval* lval_tail(lenv* e, lval* expr, int frame) {
+  tail.env = e;
+  tail.expr = expr;
+  tail.frame = frame;
+  return &tail_call;
+}
+
+// Evaluate x in tail position the way 'eval' would evaluate the list
+// {x}, without building it
+lval* lval_tail_elem(lenv* e, lval* x) {
+  if (lval_type(x) == LVAL_SEXPR) { return lval_tail(e, x, 0); }
+  return lval_eval(e, x);
+}
+
+// Frame owned by an evaluation loop after it takes the pending tail
+// call. A new frame replaces the one the loop owns, which is finished.
+lenv* lval_tail_frame(lenv* frame) {
+  if (!tail.frame) { return frame; }
+  if (frame) {
+    lenv_absorb(tail.env, frame);
+    gc_pop_env();
+    lenv_del(frame);
+  }
+  gc_push_env(tail.env);
+  return tail.env;
+}
+
 lval* builtin_load(lenv* e, lval* a) {
   LASSERT_NUM("load", a, 1);
   LASSERT_TYPE("load", a, 0, LVAL_STR);
@@ -456,23 +1433,28 @@ lval* builtin_load(lenv* e, lval* a) {
   if (mpc_parse_contents(a->cell[0]->str, Tyson, &r)) {
     
     // Read contents
+    GC_FRAME;
     lval* expr = lval_read(r.output);
+    GC_ROOT(expr);
     mpc_ast_delete(r.output);
-
-    // Evaluate expressions
-    while (expr->count) {
-      lval* x = lval_eval(e, lval_pop(expr, 0));
+    lopt* opt = e == lenv_root ? lopt_new(expr) : NULL;
+
+    // Evaluate expressions, expanding the macros defined before each
+    // and then optimizing it
+    for (int i = 0; i < expr->count; i++) {
+      lval* x = lval_expand(expr->cell[i]);
+      x = lval_optimize(opt, x, i);
+      lval_share(x);
+      expr->cell[i] = x;
+      gc_write_barrier(expr, x);
+      x = lval_eval(e, x);
       // If eval leads to error print it
-      if (x->type == LVAL_ERR) { lval_println(x); }
-      lval_del(x);
+      if (lval_type(x) == LVAL_ERR) { lval_println(x); }
     }
-    
-    // Delete expressions and args
-    lval_del(expr);    
-    lval_del(a);
+    lopt_del(opt);
     
     // Return empty list
-    return lval_sexpr();
+    GC_RETURN(lval_sexpr());
     
   } else {
     // Get parse Error as str
@@ -484,7 +1466,6 @@ lval* builtin_load(lenv* e, lval* a) {
     
     // Cleanup and return Error
     free(err_msg);
-    lval_del(a);
     return err;
   }
 }
@@ -497,9 +1478,8 @@ lval* builtin_print(lenv* e, lval* a) {
     putchar(' ');
   }
 
-  /* Print a newline and delete arguments */
+  /* Print a newline */
   putchar('\n');
-  lval_del(a);
 
   return lval_sexpr();
 }
@@ -509,567 +1489,2335 @@ lval* builtin_error(lenv* e, lval* a) {
   LASSERT_TYPE("error", a, 0, LVAL_STR);
 
   // Construct Error from first argument
-  lval* err = lval_err(a->cell[0]->str);
+  return lval_err(a->cell[0]->str);
+}
+
+lval* builtin_head(lenv* e, lval* a) {
+  // Check Error conditions 
+  LASSERT(a, a->count == 1,
+    "Function 'head' passed too many arguments. "
+    "Got %i, Expected %i.",
+    a->count, 1);
+  LASSERT(a, lval_type(a->cell[0]) == LVAL_QEXPR, "Function 'head' passed incorrect types!")
+  LASSERT(a, a->cell[0]->count != 0, "Function 'head' passed {}!")
+
+  lval* l = a->cell[0];
+
+  // Unshared list, drop all but the first element in place
+  if (!lval_shared(l)) {
+    l->count = 1;
+    lval_shrink(l);
+    return l;
+  }
+
+  // Otherwise a view of the first element
+  return lval_view(l, 0, 1);
+}
+
+lval* builtin_tail(lenv* e, lval* a) {
+  // Check Error conditions 
+  LASSERT(a, a->count == 1, "Function 'tail' passed too many arguments!");
+  LASSERT(a, lval_type(a->cell[0]) == LVAL_QEXPR, "Function 'tail' passed incorrect types!");
+  LASSERT(a, a->cell[0]->count != 0, "Function 'tail' passed {}!");
+
+  // A view of all but the first element, nothing is copied
+  return lval_view(a->cell[0], 1, a->cell[0]->count - 1);
+}
+
+lval* builtin_take(lenv* e, lval* a) {
+  LASSERT_NUM("take", a, 2);
+  LASSERT_TYPE("take", a, 0, LVAL_NUM);
+  LASSERT_TYPE("take", a, 1, LVAL_QEXPR);
+
+  long n = lval_num_value(a->cell[0]);
+  lval* l = a->cell[1];
+  LASSERT(a, n >= 0 && n <= l->count,
+    "Function 'take' passed %li for a list of %i elements.", n, l->count);
+
+  return lval_view(l, 0, n);
+}
+
+lval* builtin_drop(lenv* e, lval* a) {
+  LASSERT_NUM("drop", a, 2);
+  LASSERT_TYPE("drop", a, 0, LVAL_NUM);
+  LASSERT_TYPE("drop", a, 1, LVAL_QEXPR);
+
+  long n = lval_num_value(a->cell[0]);
+  lval* l = a->cell[1];
+  LASSERT(a, n >= 0 && n <= l->count,
+    "Function 'drop' passed %li for a list of %i elements.", n, l->count);
+
+  return lval_view(l, n, l->count - n);
+}
+
+lval* builtin_len(lenv* e, lval* a) {
+  LASSERT_NUM("len", a, 1);
+  LASSERT_TYPE("len", a, 0, LVAL_QEXPR);
+
+  return lval_num(a->cell[0]->count);
+}
+
+lval* builtin_nth(lenv* e, lval* a) {
+  LASSERT_NUM("nth", a, 2);
+  LASSERT_TYPE("nth", a, 0, LVAL_NUM);
+  LASSERT_TYPE("nth", a, 1, LVAL_QEXPR);
+
+  long n = lval_num_value(a->cell[0]);
+  lval* l = a->cell[1];
+  LASSERT(a, n >= 0 && n < l->count,
+    "Function 'nth' passed %li for a list of %i elements.", n, l->count);
+
+  // The element is evaluated like fst does with eval
+  return lval_tail_elem(e, l->cell[n]);
+}
+
+lval* builtin_last(lenv* e, lval* a) {
+  LASSERT_NUM("last", a, 1);
+  LASSERT_TYPE("last", a, 0, LVAL_QEXPR);
+  LASSERT_NOT_EMPTY("last", a, 0);
+
+  lval* l = a->cell[0];
+  return lval_tail_elem(e, l->cell[l->count - 1]);
+}
+
+lval* builtin_init(lenv* e, lval* a) {
+  LASSERT_NUM("init", a, 1);
+  LASSERT_TYPE("init", a, 0, LVAL_QEXPR);
+  LASSERT_NOT_EMPTY("init", a, 0);
+
+  // A view of all but the last element
+  return lval_view(a->cell[0], 0, a->cell[0]->count - 1);
+}
+
+lval* builtin_reverse(lenv* e, lval* a) {
+  LASSERT_NUM("reverse", a, 1);
+  LASSERT_TYPE("reverse", a, 0, LVAL_QEXPR);
+
+  lval* l = a->cell[0];
+  lval* v = lval_qexpr();
+  lval_reserve(v, l->count);
+  for (int i = l->count - 1; i >= 0; i--) {
+    lval_share(l->cell[i]);
+    v->cell[v->count++] = l->cell[i];
+    gc_write_barrier(v, l->cell[i]);
+  }
+  return v;
+}
+
+// The higher order functions call back with one argument list, reused
+// for every element. Everything they hold across a callback is rooted.
+
+lval* builtin_map(lenv* e, lval* a) {
+  LASSERT_NUM("map", a, 2);
+  LASSERT_FUN("map", a, 0);
+  LASSERT_TYPE("map", a, 1, LVAL_QEXPR);
+
+  GC_FRAME;
+  GC_ROOT(a);
+  lval* args = lval_sexpr();
+  GC_ROOT(args);
+  lval* v = lval_qexpr();
+  GC_ROOT(v);
+  lval_reserve(v, a->cell[1]->count);
+
+  for (int i = 0; i < a->cell[1]->count; i++) {
+    lval* x = lval_eval(e, a->cell[1]->cell[i]);
+    args->count = 0;
+    lval* r = lval_callback(e, a->cell[0], lval_add(args, x));
+    if (lval_type(r) == LVAL_ERR) { GC_RETURN(r); }
+    lval_add(v, r);
+  }
+  GC_RETURN(v);
+}
+
+lval* builtin_filter(lenv* e, lval* a) {
+  LASSERT_NUM("filter", a, 2);
+  LASSERT_FUN("filter", a, 0);
+  LASSERT_TYPE("filter", a, 1, LVAL_QEXPR);
+
+  GC_FRAME;
+  GC_ROOT(a);
+  lval* args = lval_sexpr();
+  GC_ROOT(args);
+  lval* v = lval_qexpr();
+  GC_ROOT(v);
+  lval_reserve(v, a->cell[1]->count);
+
+  for (int i = 0; i < a->cell[1]->count; i++) {
+    lval* x = lval_eval(e, a->cell[1]->cell[i]);
+    args->count = 0;
+    lval* r = lval_callback(e, a->cell[0], lval_add(args, x));
+    if (lval_type(r) == LVAL_ERR) { GC_RETURN(r); }
+    if (lval_type(r) != LVAL_NUM) {
+      GC_RETURN(lval_err("Function 'filter' passed a function returning %s, "
+        "Expected %s.", ltype_name(lval_type(r)), ltype_name(LVAL_NUM)));
+    }
+
+    // Elements kept are the ones in the list, not evaluated
+    if (lval_num_value(r)) {
+      lval_share(a->cell[1]->cell[i]);
+      lval_add(v, a->cell[1]->cell[i]);
+    }
+  }
+  lval_shrink(v);
+  GC_RETURN(v);
+}
+
+// Fold list l with f from the left or the right, starting from z
+lval* builtin_fold(lenv* e, lval* a, char* func, int right) {
+  LASSERT_NUM(func, a, 3);
+  LASSERT_FUN(func, a, 0);
+  LASSERT_TYPE(func, a, 2, LVAL_QEXPR);
+
+  GC_FRAME;
+  GC_ROOT(a);
+  lval* args = lval_sexpr();
+  GC_ROOT(args);
+  lval* z = a->cell[1];
+  GC_ROOT(z);
+
+  int n = a->cell[2]->count;
+  for (int k = 0; k < n; k++) {
+    lval* x = lval_eval(e, a->cell[2]->cell[right ? n - 1 - k : k]);
+
+    // The element goes first folding from the right
+    args->count = 0;
+    if (right) {
+      lval_add(lval_add(args, x), z);
+    } else {
+      lval_add(lval_add(args, z), x);
+    }
+    z = lval_callback(e, a->cell[0], args);
+    if (lval_type(z) == LVAL_ERR) { GC_RETURN(z); }
+  }
+  GC_RETURN(z);
+}
+
+lval* builtin_foldl(lenv* e, lval* a) {
+  return builtin_fold(e, a, "foldl", 0);
+}
+
+lval* builtin_foldr(lenv* e, lval* a) {
+  return builtin_fold(e, a, "foldr", 1);
+}
+
+lval* builtin_list(lenv* e, lval* a) {
+  // The argument list is always fresh, retag it in place
+  a->type = LVAL_QEXPR;
+  return a;
+}
+
+lval* builtin_eval(lenv* e, lval* a) {
+  LASSERT(a, a->count == 1, "Function 'eval' passed to many arguments!");
+  LASSERT(a, lval_type(a->cell[0]) == LVAL_QEXPR, "Function 'eval' passed incorrect type!")
 
-  // Delete args
-  lval_del(a);
-  return err;
+  // Evaluate the Q-Expression as an S-Expression
+  return lval_tail(e, a->cell[0], 0);
 }
 
-lval* builtin_op(lenv* e, lval* a, char* op) {
-  // Check all arguments for type number
+lval* builtin_join(lenv* e, lval* a) {
+
   for (int i = 0; i < a->count; i++)
   {
-    if (a->cell[i]->type != LVAL_NUM){
-      lval_del(a);
-      return lval_err("Cannot operate on non-number!");
+    LASSERT(a, lval_type(a->cell[i]) == LVAL_QEXPR, "Function 'join' passed incorrect type!");
+  }
+
+  if (a->count == 0) { return lval_qexpr(); }
+
+  // Lists are only changed in place when unshared, see lval_concat
+  lval* x = a->cell[0];
+  for (int i = 1; i < a->count; i++) {
+    x = lval_concat(x, a->cell[i]);
+  }
+
+  return x;
+}
+
+
+lval* builtin_var(lenv* e, lval* a, char* func,
+  void (*bind)(lenv*, lval*, lval*)) {
+  LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+
+  lval* syms = a->cell[0];
+  for (int i = 0; i < syms->count; i++) {
+    LASSERT(a, (lval_type(syms->cell[i]) == LVAL_SYM),
+    "Function '%s' cannot define non-symbol. "
+    "Got %s, Expected %s.", func,
+    ltype_name(lval_type(syms->cell[i])),
+    ltype_name(LVAL_SYM));
+  }
+
+  LASSERT(a, (syms->count == a->count -1),
+    "Function '%s' passed too many arguments for Symbols. ",
+    "Got %i, Expected %i.", func, syms->count, a->count-1);
+
+  // 'def' binds with lenv_def in global, '=' with lenv_put in local env
+  for (int i = 0; i < syms->count; i++) {
+    bind(e, syms->cell[i], a->cell[i+1]);
+  }
+
+  return lval_sexpr();
+}
+
+lval* lval_call(lenv* e, lval* f, lval* a) {
+  // If builtin call it
+  if (lval_type(f) == LVAL_FUN && f->builtin) {
+    return f->builtin(e, a);
+  }
+
+  // A partial application passes its arguments ahead of these
+  lval** bound = NULL;
+  int nbound = 0;
+  if (lval_type(f) == LVAL_PART) {
+    bound = f->args;
+    nbound = f->nargs;
+    f = f->base;
+  }
+
+  // Macros only exist for forms read after they are defined
+  if (f->flags & LVAL_MACRO) {
+    return lval_err("Macro called at run time. "
+      "Define it before the forms that use it.");
+  }
+
+  lval* formals = f->formals;
+
+  // Record argument counts 
+  int given = nbound + a->count;
+  int total = formals->count;
+
+  // Formals bound one to one, those before any '&'
+  int fixed = 0;
+  while (fixed < total && formals->cell[fixed]->sym != sym_amp) {
+    fixed++;
+  }
+
+  // Too few arguments, keep them until the rest are given
+  if (given < fixed) {
+    return lval_part(f, bound, nbound, a->cell, a->count);
+  }
+
+  if (fixed == total && given > total) {
+    return lval_err(
+      "Function passed too many arguments. "
+      "Got %i, Expected %i.", given, total);
+  }
+
+  // Make sure '&' is followed by Symbol
+  if (fixed < total && total - fixed != 2) {
+    if (given > fixed) {
+      return lval_err("Function format invalid. "
+      "Symbol '&' not followed by single symbol.");
     }
+    return lval_err("Function format invald. "
+    "Symbol '&' not followed by single symbol");
   }
 
-  // Pop first element
-  lval* x = lval_pop(a, 0);
+  // Functions are never changed by a call, the arguments are bound in
+  // a new frame
+  lenv* env = lenv_new();
+  for (int i = 0; i < fixed; i++) {
+    lenv_put(env, formals->cell[i],
+      i < nbound ? bound[i] : a->cell[i - nbound]);
+  }
 
-  // If no arguments and sub then perform unary negation
-  if ((strcmp(op, "-") == 0) && a->count == 0) {
-    x->num = -x->num;
+  // Symbol after '&' is bound to the remaining arguments
+  if (fixed < total) {
+    lval* rest = lval_qexpr();
+    for (int i = fixed; i < given; i++) {
+      lval_add(rest, i < nbound ? bound[i] : a->cell[i - nbound]);
+    }
+    lenv_put(env, formals->cell[fixed + 1], rest);
   }
 
-  // While there are elements remaining
-  while (a->count > 0) {
-    
-    lval* y = lval_pop(a, 0);
-
-    if (strcmp(op, "+") == 0) { x->num += y->num; }
-    if (strcmp(op, "-") == 0) { x->num -= y->num; }
-    if (strcmp(op, "*") == 0) { x->num *= y->num; }
-    if (strcmp(op, "/") == 0) {
-      if (y->num == 0) {
-        lval_del(x);
-        lval_del(y);
-        x = lval_err("Division by zero!");
-        break;
+  // Set parent enviornment
+  env->par = e;
+
+  // Body is in tail position, the caller frees the environment
+  return lval_tail(env, f->body, 1);
+}
+
+lval* builtin_def(lenv* e, lval* a) {
+  return builtin_var(e, a, "def", lenv_def);
+}
+
+lval* builtin_put(lenv* e, lval* a) {
+  return builtin_var(e, a, "=", lenv_put);
+}
+
+// Point every symbol in v naming one of the formals at the slot
+// lval_call binds it to. Bindings are in formals order with '&'
+// skipped. Scoping is dynamic, so free symbols, including formals
+// of enclosing functions, are left to lenv_get to search for.
+void lval_resolve(lval* formals, lval* v) {
+  switch (lval_type(v)) {
+    case LVAL_SYM:
+      for (int i = 0, slot = 0; i < formals->count; i++) {
+        if (formals->cell[i]->sym == sym_amp) { continue; }
+        if (formals->cell[i]->sym == v->sym) { v->slot = slot; return; }
+        slot++;
       }
-      x->num /= y->num;
-     }
-    lval_del(y);
+    break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      for (int i = 0; i < v->count; i++) {
+        lval_resolve(formals, v->cell[i]);
+      }
+    break;
   }
-  lval_del(a);
-  return x;
 }
 
-lval* builtin_add(lenv* e, lval* a) {
-  return builtin_op(e, a, "+");
+lval* builtin_lambda(lenv* e, lval* a) {
+  // Check arguments
+  LASSERT_NUM("\\", a, 2);
+  LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
+  LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
+
+  // Check first Q-expression for Symbols
+  for (int i = 0; i < a->cell[0]->count; i++) {
+    LASSERT(a, (lval_type(a->cell[0]->cell[i]) == LVAL_SYM),
+    "Cannot define non-symbol. Got %s, Expected %s.",
+    ltype_name(lval_type(a->cell[0]->cell[i])), ltype_name(LVAL_SYM));
+  }
+
+  // Resolve references to the formals in the body
+  lval_resolve(a->cell[0], a->cell[1]);
+
+  // Pass both arguments to lval lambda
+  return lval_lambda(a->cell[0], a->cell[1]);
 }
 
-lval* builtin_sub(lenv* e, lval* a) {
-  return builtin_op(e, a, "-");
+// Macros are templates expanded once, when a top-level form is read by
+// 'load' or the REPL, before it is evaluated. Any call in code whose
+// head names a macro in the global environment is replaced by a copy
+// of the template, with each formal replaced by the form passed for it
+// unevaluated, and a formal after '&' by all remaining forms spliced
+// in. The result is expanded again, so templates may use other macros
+// or themselves.
+//
+// Code is S-expressions, bodies of '\', 'fun' and 'let', branches of
+// 'if' and the clauses of 'select' and 'case', see lval_code_arg.
+// Other Q-expressions are data and left alone.
+//
+// Names the template binds itself with '\' or '=' are renamed on every
+// expansion to symbols that cannot be read, so they never capture names
+// in the forms passed in.
+#define LVAL_EXPAND_MAX 1000
+#define LVAL_MACRO_NAMES 256
+
+// Names bound by the enclosing '\', 'fun' and 'defmacro' forms, which
+// are not macros inside them
+typedef struct lshadow {
+  lval* syms;
+  struct lshadow* par;
+} lshadow;
+
+// One substitution made while copying a template
+typedef struct {
+  char* sym;
+  lval* with;
+  // Splice the elements of with in place of the symbol
+  int splice;
+} lsubst;
+
+unsigned long macro_gensyms = 0;
+
+lval* builtin_defmacro(lenv* e, lval* a) {
+  LASSERT_NUM("defmacro", a, 2);
+  LASSERT_TYPE("defmacro", a, 0, LVAL_QEXPR);
+  LASSERT_TYPE("defmacro", a, 1, LVAL_QEXPR);
+  LASSERT_NOT_EMPTY("defmacro", a, 0);
+
+  lval* f = a->cell[0];
+  for (int i = 0; i < f->count; i++) {
+    LASSERT(a, (lval_type(f->cell[i]) == LVAL_SYM),
+    "Cannot define non-symbol. Got %s, Expected %s.",
+    ltype_name(lval_type(f->cell[i])), ltype_name(LVAL_SYM));
+  }
+
+  // Name first, then the formals
+  lval* formals = lval_qexpr();
+  for (int i = 1; i < f->count; i++) {
+    lval_add(formals, f->cell[i]);
+  }
+
+  lval* m = lval_lambda(formals, a->cell[1]);
+  m->flags |= LVAL_MACRO;
+  lenv_def(e, f->cell[0], m);
+  return lval_sexpr();
 }
 
-lval* builtin_mul(lenv* e, lval* a) {
-  return builtin_op(e, a, "*");
+// The global the head of list v names, or NULL if it is not a symbol
+// bound there or is bound by an enclosing form
+lval* lval_head(lval* v, lshadow* sh) {
+  if (v->count == 0 || lval_type(v->cell[0]) != LVAL_SYM) { return NULL; }
+  char* sym = v->cell[0]->sym;
+  for (; sh; sh = sh->par) {
+    for (int i = 0; i < sh->syms->count; i++) {
+      if (sh->syms->cell[i]->sym == sym) { return NULL; }
+    }
+  }
+  int i = lenv_find(lenv_root, sym);
+  return i < 0 ? NULL : lenv_root->vals[i];
 }
 
-lval* builtin_div(lenv* e, lval* a) {
-  return builtin_op(e, a, "/");
+// The macro the head of list v names, or NULL
+lval* lval_macro(lval* v, lshadow* sh) {
+  lval* m = lval_head(v, sh);
+  if (!m || lval_type(m) != LVAL_FUN || !(m->flags & LVAL_MACRO)) {
+    return NULL;
+  }
+  return m;
 }
 
-lval* builtin_head(lenv* e, lval* a) {
-  // Check Error conditions 
-  LASSERT(a, a->count == 1,
-    "Function 'head' passed too many arguments. "
-    "Got %i, Expected %i.",
-    a->count, 1);
-  LASSERT(a, a->cell[0]->type == LVAL_QEXPR, "Function 'head' passed incorrect types!")
-  LASSERT(a, a->cell[0]->count != 0, "Function 'head' passed {}!")
+// Whether list v binds the symbols in its second element, 2 if they
+// are formals of the rest of it
+int lval_binds(lval* v) {
+  if (v->count < 2 || lval_type(v->cell[0]) != LVAL_SYM) { return 0; }
+  if (lval_type(v->cell[1]) != LVAL_QEXPR) { return 0; }
+  char* s = v->cell[0]->sym;
+  if (s == sym_lambda || s == sym_fun || s == sym_defmacro) {
+    for (int i = 0; i < v->cell[1]->count; i++) {
+      if (lval_type(v->cell[1]->cell[i]) != LVAL_SYM) { return 1; }
+    }
+    return 2;
+  }
+  return s == sym_put || s == sym_def;
+}
+
+// How a Q-expression in cell i of a call to builtin b is evaluated:
+// 1 if it is code, 2 if its elements are, as clauses are not calls,
+// and 0 if it is data. fun is set for calls to 'fun'.
+int lval_code_arg(lbuiltin b, int fun, int i) {
+  if (((b == builtin_lambda || fun) && i == 2) ||
+    (b == builtin_if && i >= 2) || (b == builtin_let && i == 1)) {
+    return 1;
+  }
+  if ((b == builtin_select && i >= 1) || (b == builtin_case && i >= 2)) {
+    return 2;
+  }
+  return 0;
+}
+
+// Add a fresh name for every symbol t binds locally that has no
+// substitution yet. Returns 0 if there are more than LVAL_MACRO_NAMES.
+int lval_macro_renames(lval* t, lsubst* subst, int* n) {
+  if (lval_type(t) != LVAL_SEXPR && lval_type(t) != LVAL_QEXPR) { return 1; }
+
+  if (t->count >= 2 && lval_type(t->cell[0]) == LVAL_SYM &&
+    (t->cell[0]->sym == sym_lambda || t->cell[0]->sym == sym_put) &&
+    lval_type(t->cell[1]) == LVAL_QEXPR) {
+    lval* syms = t->cell[1];
+    for (int i = 0; i < syms->count; i++) {
+      if (lval_type(syms->cell[i]) != LVAL_SYM) { continue; }
+      char* sym = syms->cell[i]->sym;
+      if (sym == sym_amp) { continue; }
+      int found = 0;
+      for (int j = 0; j < *n; j++) {
+        if (subst[j].sym == sym) { found = 1; break; }
+      }
+      if (found) { continue; }
+      if (*n == LVAL_MACRO_NAMES) { return 0; }
+
+      char name[512];
+      snprintf(name, sizeof(name), "%s#%lu", sym, ++macro_gensyms);
+      subst[*n].sym = sym;
+      subst[*n].with = lval_sym(name);
+      subst[*n].splice = 0;
+      (*n)++;
+    }
+  }
+
+  for (int i = 0; i < t->count; i++) {
+    if (!lval_macro_renames(t->cell[i], subst, n)) { return 0; }
+  }
+  return 1;
+}
+
+// Copy of template t with the substitutions made
+lval* lval_macro_copy(lval* t, lsubst* subst, int n) {
+  switch (lval_type(t)) {
+    case LVAL_SYM:
+      for (int i = 0; i < n; i++) {
+        if (subst[i].sym != t->sym) { continue; }
+        // Symbols are copied for their own slot
+        if (lval_type(subst[i].with) == LVAL_SYM) {
+          return lval_sym(subst[i].with->sym);
+        }
+        return subst[i].with;
+      }
+    return lval_sym(t->sym);
+
+    case LVAL_SEXPR:
+    case LVAL_QEXPR: {
+      lval* v = lval_type(t) == LVAL_SEXPR ? lval_sexpr() : lval_qexpr();
+      for (int i = 0; i < t->count; i++) {
+        lval* x = t->cell[i];
+        int k = -1;
+        if (lval_type(x) == LVAL_SYM) {
+          for (int j = 0; j < n; j++) {
+            if (subst[j].sym == x->sym && subst[j].splice) { k = j; }
+          }
+        }
+        if (k >= 0) {
+          for (int j = 0; j < subst[k].with->count; j++) {
+            lval_add(v, subst[k].with->cell[j]);
+          }
+        } else {
+          lval_add(v, lval_macro_copy(x, subst, n));
+        }
+      }
+      return v;
+    }
+  }
+  // Other values are never changed
+  return t;
+}
+
+// Expansion of use v of macro m, a list of the same type as v
+lval* lval_macro_apply(lval* m, lval* v) {
+  lval* formals = m->formals;
+  char* name = v->cell[0]->sym;
+
+  // A substitution for every formal and local name in the template
+  lsubst subst[LVAL_MACRO_NAMES];
+  int n = 0;
+  if (formals->count > LVAL_MACRO_NAMES) {
+    return lval_err("Macro '%s' has too many formals.", name);
+  }
+
+  int j = 1;
+  for (int i = 0; i < formals->count; i++) {
+    char* sym = formals->cell[i]->sym;
+    if (sym == sym_amp) {
+      if (formals->count - i != 2) {
+        return lval_err("Macro '%s' format invalid. "
+          "Symbol '&' not followed by single symbol.", name);
+      }
+      lval* rest = lval_qexpr();
+      while (j < v->count) { lval_add(rest, v->cell[j++]); }
+      subst[n++] = (lsubst){ formals->cell[i+1]->sym, rest, 1 };
+      break;
+    }
+    if (j == v->count) {
+      return lval_err("Macro '%s' passed too few arguments. "
+        "Got %i, Expected %i.", name, v->count - 1, formals->count);
+    }
+    subst[n++] = (lsubst){ sym, v->cell[j++], 0 };
+  }
+  if (j < v->count) {
+    return lval_err("Macro '%s' passed too many arguments. "
+      "Got %i, Expected %i.", name, v->count - 1, formals->count);
+  }
+
+  if (!lval_macro_renames(m->body, subst, &n)) {
+    return lval_err("Macro '%s' binds too many names.", name);
+  }
+  lval* x = lval_macro_copy(m->body, subst, n);
+  x->type = lval_type(v);
+  return x;
+}
 
-  // Take first argument
-  lval* v = lval_take(a, 0);
+// Expand the macros in v, a call in code
+lval* lval_expand_depth(lval* v, lshadow* sh, int depth) {
+  if (lval_type(v) != LVAL_SEXPR && lval_type(v) != LVAL_QEXPR) { return v; }
 
-  // Delete all elements that are not head and return
-  while (v->count > 1) {
-    lval_del(lval_pop(v, 1));
+  // Replace uses of macros until the head is something else
+  lval* m;
+  while ((m = lval_macro(v, sh))) {
+    if (++depth > LVAL_EXPAND_MAX) {
+      return lval_err("Macro '%s' expanded too deeply.", v->cell[0]->sym);
+    }
+    v = lval_macro_apply(m, v);
+    if (lval_type(v) == LVAL_ERR) { return v; }
   }
 
+  // Which arguments are code depends on the builtin called
+  lval* f = lval_head(v, sh);
+  lbuiltin b = f && lval_type(f) == LVAL_FUN ? f->builtin : NULL;
+  int fun = v->count && lval_type(v->cell[0]) == LVAL_SYM &&
+    v->cell[0]->sym == sym_fun;
+
+  // The names bound by a binding form are left alone
+  int binds = lval_binds(v);
+  lshadow inner = { binds == 2 ? v->cell[1] : NULL, sh };
+  if (inner.syms) { sh = &inner; }
+  for (int i = 0; i < v->count; i++) {
+    if (binds && i == 1) { continue; }
+    lval* x = v->cell[i];
+    int code = lval_type(x) == LVAL_QEXPR ? lval_code_arg(b, fun, i) : 1;
+    if (code == 1) {
+      x = lval_expand_depth(x, sh, depth + 1);
+    } else if (code == 2) {
+      for (int j = 0; j < x->count; j++) {
+        if (lval_type(x->cell[j]) != LVAL_SEXPR) { continue; }
+        lval* y = lval_expand_depth(x->cell[j], sh, depth + 1);
+        if (lval_type(y) == LVAL_ERR) { return y; }
+        x->cell[j] = y;
+        gc_write_barrier(x, y);
+      }
+    }
+    if (lval_type(x) == LVAL_ERR) { return x; }
+    v->cell[i] = x;
+    gc_write_barrier(v, x);
+  }
   return v;
 }
 
-lval* builtin_tail(lenv* e, lval* a) {
-  // Check Error conditions 
-  LASSERT(a, a->count == 1, "Function 'tail' passed too many arguments!");
-  LASSERT(a, a->cell[0]->type == LVAL_QEXPR, "Function 'tail' passed incorrect types!");
-  LASSERT(a, a->cell[0]->count != 0, "Function 'tail' passed {}!");
+// Expand every use of a macro in the top-level form v, in place
+lval* lval_expand(lval* v) {
+  if (lval_type(v) != LVAL_SEXPR) { return v; }
+  return lval_expand_depth(v, NULL, 0);
+}
+
+int lval_eq(lval* x, lval* y) {
+  // Different Types are always unequal
+  if (lval_type(x) != lval_type(y)) { return 0; }
+
+  // Compare Base upon type
+  switch (lval_type(x)) {
+    // Compare Number Value
+    case LVAL_NUM: return (lval_num_value(x) == lval_num_value(y));
+
+    // Compare String Values
+    case LVAL_ERR: return (strcmp(x->err, y->err) == 0);
+    case LVAL_SYM: return (x->sym == y->sym);
+    case LVAL_STR: return (strcmp(x->str, y->str) == 0);
+
+    // If builtin compare, otherwise compare formals and body
+    case LVAL_FUN:
+      if (x->builtin || y->builtin) {
+        return x->builtin == y->builtin;
+      } else {
+        return lval_eq(x->formals, y->formals)
+        && lval_eq(x->body, y->body);
+      }
+
+    // Same function with equal arguments given so far
+    case LVAL_PART:
+      if (x->nargs != y->nargs || !lval_eq(x->base, y->base)) { return 0; }
+      for (int i = 0; i < x->nargs; i++) {
+        if (!lval_eq(x->args[i], y->args[i])) { return 0; }
+      }
+      return 1;
+
+    // If list compare every individual element
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+      if (x->count != y->count) { return 0; }
+      for (int i = 0; i < x->count; i++) {
+        // If any element is not equal return not equal
+        if (!lval_eq(x->cell[i], y->cell[i])) { return 0; }
+      }
+      // Otherwise lists are equal
+      return 1;
+    break;
+  }
+  return 0;
+}
+
+// Builtins on numbers, one row each of
+//   X(name, NAME, symbol, kind, result for longs x and y)
+// From it come builtin_name, ARITH_NAME and the vm_arith entry the VM
+// and the JIT apply directly. Kind OP folds any number of arguments
+// left to right, ORD compares two numbers and CMP compares any two
+// values, as lval_eq of them against 1 when they are not both fixnums.
+// Arithmetic wraps on overflow.
+#define LVAL_NUM_OPS(X) \
+  X(add, ADD, "+",  OP,  (long)((unsigned long)x + (unsigned long)y)) \
+  X(sub, SUB, "-",  OP,  (long)((unsigned long)x - (unsigned long)y)) \
+  X(mul, MUL, "*",  OP,  (long)((unsigned long)x * (unsigned long)y)) \
+  X(div, DIV, "/",  OP,  x / y) \
+  X(gt,  GT,  ">",  ORD, x >  y) \
+  X(lt,  LT,  "<",  ORD, x <  y) \
+  X(ge,  GE,  ">=", ORD, x >= y) \
+  X(le,  LE,  "<=", ORD, x <= y) \
+  X(eq,  EQ,  "==", CMP, x == y) \
+  X(ne,  NE,  "!=", CMP, x != y)
+
+#define ARITH_ENUM(n, N, s, k, r) ARITH_##N,
+enum { LVAL_NUM_OPS(ARITH_ENUM) ARITH_COUNT };
+
+// Every kernel starts with the common case of two fixnums
+#define LVAL_KERNEL_FAST(N, r) \
+  if (a->count == 2 && \
+    lval_is_fixnum(a->cell[0]) && lval_is_fixnum(a->cell[1])) { \
+    long x = lval_num_value(a->cell[0]); \
+    long y = lval_num_value(a->cell[1]); \
+    if (ARITH_##N == ARITH_DIV && y == 0) { \
+      return lval_err("Division by zero!"); \
+    } \
+    return lval_num(r); \
+  }
+
+#define LVAL_KERNEL_OP(n, N, s, r) \
+lval* builtin_##n(lenv* e, lval* a) { \
+  LVAL_KERNEL_FAST(N, r) \
+  for (int i = 0; i < a->count; i++) { \
+    if (lval_type(a->cell[i]) != LVAL_NUM) { \
+      return lval_err("Cannot operate on non-number!"); \
+    } \
+  } \
+  long x = lval_num_value(a->cell[0]); \
+  if (ARITH_##N == ARITH_SUB && a->count == 1) { \
+    x = (long)(0UL - (unsigned long)x); \
+  } \
+  for (int i = 1; i < a->count; i++) { \
+    long y = lval_num_value(a->cell[i]); \
+    if (ARITH_##N == ARITH_DIV && y == 0) { \
+      return lval_err("Division by zero!"); \
+    } \
+    x = r; \
+  } \
+  return lval_num(x); \
+}
+
+#define LVAL_KERNEL_ORD(n, N, s, r) \
+lval* builtin_##n(lenv* e, lval* a) { \
+  LVAL_KERNEL_FAST(N, r) \
+  LASSERT_NUM(s, a, 2); \
+  LASSERT_TYPE(s, a, 0, LVAL_NUM); \
+  LASSERT_TYPE(s, a, 1, LVAL_NUM); \
+  long x = lval_num_value(a->cell[0]); \
+  long y = lval_num_value(a->cell[1]); \
+  return lval_num(r); \
+}
+
+#define LVAL_KERNEL_CMP(n, N, s, r) \
+lval* builtin_##n(lenv* e, lval* a) { \
+  LVAL_KERNEL_FAST(N, r) \
+  LASSERT_NUM(s, a, 2); \
+  long x = lval_eq(a->cell[0], a->cell[1]); \
+  long y = 1; \
+  return lval_num(r); \
+}
+
+#define LVAL_KERNEL(n, N, s, k, r) LVAL_KERNEL_##k(n, N, s, r)
+LVAL_NUM_OPS(LVAL_KERNEL)
+
+lval* builtin_if(lenv* e, lval* a) {
+  LASSERT_NUM("if", a, 3);
+  LASSERT_TYPE("if", a, 0, LVAL_NUM);
+  LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
+  LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
+
+  // Both Expressions are evaluated as S-Expressions
+  if (lval_num_value(a->cell[0])) {
+    // If condition is true eval first expression
+    return lval_tail(e, a->cell[1], 0);
+  } else {
+    // Otherwise eval second expression
+    return lval_tail(e, a->cell[2], 0);
+  }
+}
+
+// Clauses of 'select' and 'case' are pairs of a test and a value,
+// only evaluated up to the first that matches
+#define LASSERT_CLAUSES(func, args, first) \
+  for (int i = first; i < args->count; i++) { \
+    LASSERT_TYPE(func, args, i, LVAL_QEXPR); \
+    LASSERT(args, args->cell[i]->count == 2, \
+      "Function '%s' passed clause of %i elements for argument %i. " \
+      "Expected %i.", func, args->cell[i]->count, i, 2); \
+  }
+
+lval* builtin_select(lenv* e, lval* a) {
+  LASSERT_CLAUSES("select", a, 0);
+
+  // The arguments move if evaluating a condition collects
+  GC_FRAME;
+  GC_ROOT(a);
+  for (int i = 0; i < a->count; i++) {
+    lval* c = lval_eval(e, a->cell[i]->cell[0]);
+    if (lval_type(c) == LVAL_ERR) { GC_RETURN(c); }
+    if (lval_type(c) != LVAL_NUM) {
+      GC_RETURN(lval_err(
+        "Function 'select' passed incorrect type for condition %i. "
+        "Got %s, Expected %s.", i, ltype_name(lval_type(c)), ltype_name(LVAL_NUM)));
+    }
+    if (lval_num_value(c)) {
+      GC_RETURN(lval_tail_elem(e, a->cell[i]->cell[1]));
+    }
+  }
+  GC_RETURN(lval_err("No Selection Found"));
+}
+
+lval* builtin_case(lenv* e, lval* a) {
+  LASSERT(a, a->count > 0,
+    "Function 'case' passed incorrect number of arguments. "
+    "Got %i, Expected at least %i.", a->count, 1);
+  LASSERT_CLAUSES("case", a, 1);
+
+  GC_FRAME;
+  GC_ROOT(a);
+  for (int i = 1; i < a->count; i++) {
+    lval* k = lval_eval(e, a->cell[i]->cell[0]);
+    if (lval_type(k) == LVAL_ERR) { GC_RETURN(k); }
+    if (lval_eq(a->cell[0], k)) {
+      GC_RETURN(lval_tail_elem(e, a->cell[i]->cell[1]));
+    }
+  }
+  GC_RETURN(lval_err("No Case Found"));
+}
+
+lval* builtin_do(lenv* e, lval* a) {
+  // Arguments were evaluated in order, the last is the result
+  if (a->count == 0) { return lval_qexpr(); }
+  return a->cell[a->count-1];
+}
+
+lval* builtin_let(lenv* e, lval* a) {
+  LASSERT_NUM("let", a, 1);
+  LASSERT_TYPE("let", a, 0, LVAL_QEXPR);
+
+  // Evaluate in a new scope, a call frame freed once it is done
+  lenv* frame = lenv_new();
+  frame->par = e;
+  return lval_tail(frame, a->cell[0], 1);
+}
+
+lval* lval_join(lval* x, lval* y) {
+  // Append all cells of y to x with at most one reallocation, y is
+  // left untouched so its elements are now shared
+  lval_reserve(x, x->count + y->count);
+  for (int i = 0; i < y->count; i++) {
+    lval_share(y->cell[i]);
+    x->cell[x->count++] = y->cell[i];
+    gc_write_barrier(x, y->cell[i]);
+  }
+  return x;
+}
+
+// Joins giving at least this many elements build a buffer
+#define LVAL_BUFFER_MIN 8
+
+// Buffer for n cells, with as many free around them for later joins
+lval* lval_buffer(int n) {
+  lval* b = lval_alloc();
+  b->type = LVAL_QEXPR;
+  b->flags = LVAL_SHARED | LVAL_BUFFER;
+  b->count = n * 2;
+  b->cell = cell_alloc(b->count);
+  b->lo = b->hi = n / 2;
+  return b;
+}
+
+// Copy the elements of l to buffer b from cell i on, they are shared
+void lval_buffer_put(lval* b, int i, lval* l) {
+  for (int j = 0; j < l->count; j++) {
+    lval_share(l->cell[j]);
+    b->cell[i + j] = l->cell[j];
+    gc_write_barrier(b, l->cell[j]);
+  }
+}
+
+// Buffer v is a view of, or NULL
+lval* lval_buffer_of(lval* v) {
+  if (!(v->flags & LVAL_VIEW)) { return NULL; }
+  return (v->owner->flags & LVAL_BUFFER) ? v->owner : NULL;
+}
+
+// The elements of x followed by those of y. Joining onto either end
+// of the cells in use by a buffer fills its free cells, so building a
+// list one join at a time does not copy it each time.
+lval* lval_concat(lval* x, lval* y) {
+  int n = x->count;
+  int m = y->count;
+  if (m == 0) { return x; }
+  if (n == 0) { return y; }
+
+  // x ends where the buffer does, append to it
+  lval* b = lval_buffer_of(x);
+  if (b && x->cell + n == b->cell + b->hi && b->count - b->hi >= m) {
+    lval_buffer_put(b, b->hi, y);
+    b->hi += m;
+    return lval_view(b, x->cell - b->cell, n + m);
+  }
+
+  // y starts where the buffer does, prepend to it
+  b = lval_buffer_of(y);
+  if (b && y->cell == b->cell + b->lo && b->lo >= n) {
+    b->lo -= n;
+    lval_buffer_put(b, b->lo, x);
+    return lval_view(b, b->lo, n + m);
+  }
+
+  // Small joins copy, in place to x if it is unshared and no shorter
+  if (!lval_shared(x) && m <= n) { return lval_join(x, y); }
+  if (n + m < LVAL_BUFFER_MIN) {
+    lval* v = lval_qexpr();
+    lval_reserve(v, n + m);
+    return lval_join(lval_join(v, x), y);
+  }
+
+  // Otherwise a new buffer with room on both ends
+  b = lval_buffer(n + m);
+  lval_buffer_put(b, b->lo, x);
+  lval_buffer_put(b, b->lo + n, y);
+  b->hi = b->lo + n + m;
+  return lval_view(b, b->lo, n + m);
+}
+
+
+lval* lval_builtin(lbuiltin func) {
+  return lval_fun(func);
+}
+
+void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
+  lval* k = lval_sym(name);
+  lval* v = lval_builtin(func);
+  lenv_put(e, k, v);
+}
+
+void lenv_add_builtins(lenv* e) {
+  // List Functions
+  lenv_add_builtin(e, "list", builtin_list);
+  lenv_add_builtin(e, "head", builtin_head);
+  lenv_add_builtin(e, "tail", builtin_tail);
+  lenv_add_builtin(e, "take", builtin_take);
+  lenv_add_builtin(e, "drop", builtin_drop);
+  lenv_add_builtin(e, "len", builtin_len);
+  lenv_add_builtin(e, "nth", builtin_nth);
+  lenv_add_builtin(e, "last", builtin_last);
+  lenv_add_builtin(e, "init", builtin_init);
+  lenv_add_builtin(e, "reverse", builtin_reverse);
+  lenv_add_builtin(e, "map", builtin_map);
+  lenv_add_builtin(e, "filter", builtin_filter);
+  lenv_add_builtin(e, "foldl", builtin_foldl);
+  lenv_add_builtin(e, "foldr", builtin_foldr);
+  lenv_add_builtin(e, "eval", builtin_eval);
+  lenv_add_builtin(e, "join", builtin_join);
+  
+  // Mathematical Functions
+  lenv_add_builtin(e, "+", builtin_add);
+  lenv_add_builtin(e, "-", builtin_sub);
+  lenv_add_builtin(e, "*", builtin_mul);
+  lenv_add_builtin(e, "/", builtin_div);
+
+  // Variable Functions
+  lenv_add_builtin(e, "\\",  builtin_lambda); 
+  lenv_add_builtin(e, "def", builtin_def);
+  lenv_add_builtin(e, "=",   builtin_put);
+  lenv_add_builtin(e, "defmacro", builtin_defmacro);
+
+  // Comparison Functions
+  lenv_add_builtin(e, "if", builtin_if);
+  lenv_add_builtin(e, "==", builtin_eq);
+  lenv_add_builtin(e, "!=", builtin_ne);
+  lenv_add_builtin(e, ">", builtin_gt);
+  lenv_add_builtin(e, "<", builtin_lt);
+  lenv_add_builtin(e, ">=", builtin_ge);
+  lenv_add_builtin(e, "<=", builtin_le);
 
-  // Take first argument
-  lval* v = lval_take(a, 0);
+  // Control Functions
+  lenv_add_builtin(e, "select", builtin_select);
+  lenv_add_builtin(e, "case", builtin_case);
+  lenv_add_builtin(e, "do", builtin_do);
+  lenv_add_builtin(e, "let", builtin_let);
+
+  // String Functions
+  lenv_add_builtin(e, "load", builtin_load);
+  lenv_add_builtin(e, "error", builtin_error);
+  lenv_add_builtin(e, "print", builtin_print);
+}
 
-  // Delete first element and return rest
-  lval_del(lval_pop(v, 0));
+
+// Evaluator for S-expressions, the tree walker below or the bytecode
+// VM, see --interp
+enum { INTERP_AST, INTERP_VM };
+int lval_interp = INTERP_VM;
+
+lval* lval_eval(lenv* e, lval* v) {
+  if (lval_type(v) == LVAL_SYM) {
+    return lenv_get(e, v);
+  }
+  // Evaluate S-expression
+  if (lval_type(v) == LVAL_SEXPR) {
+    if (lval_interp == INTERP_VM) { return vm_run(e, v, NULL); }
+    return lval_eval_sexpr(e, v, NULL);
+  }
+  // Other types remain the same
   return v;
 }
 
-lval* builtin_list(lenv* e, lval* a) {
-  a->type = LVAL_QEXPR;
-  return a;
+
+
+// Evaluate the children of v and apply the first to the rest. The
+// result is the tail call marker if the call ended in one.
+lval* lval_eval_step(lenv* e, lval* v) {
+  if (v->count == 0) { return lval_sexpr(); }
+
+  // Everything live across evaluation of the children is rooted,
+  // v itself is shared and left untouched
+  GC_FRAME;
+  GC_ROOT(v);
+  gc_maybe();
+
+  // Evaluating children
+  lval* f = lval_eval(e, v->cell[0]);
+  GC_ROOT(f);
+  lval* a = lval_sexpr();
+  GC_ROOT(a);
+  for (int i = 1; i < v->count; i++) {
+    lval* x = lval_eval(e, v->cell[i]);
+    lval_add(a, x);
+  }
+
+  // Error checking
+  if (lval_type(f) == LVAL_ERR) { GC_RETURN(f); }
+  for (int i = 0; i < a->count; i++) {
+    if (lval_type(a->cell[i]) == LVAL_ERR) { GC_RETURN(a->cell[i]); }
+  }
+
+  // Single expression
+  if (v->count == 1) { GC_RETURN(f); }
+
+  // Ensure first element is function
+  if (lval_type(f) != LVAL_FUN && lval_type(f) != LVAL_PART) {
+    GC_RETURN(lval_err(
+      "S-Expression starts with incorrect type. "
+      "Got %s, Expected %s",
+      ltype_name(lval_type(f)), ltype_name(LVAL_FUN)));
+  }
+
+  // Call builtin with operator
+  GC_RETURN(lval_call(e, f, a));
 }
 
-lval* builtin_eval(lenv* e, lval* a) {
-  LASSERT(a, a->count == 1, "Function 'eval' passed to many arguments!");
-  LASSERT(a, a->cell[0]->type == LVAL_QEXPR, "Function 'eval' passed incorrect type!")
+// Evaluate v in e, which is the call frame frame the loop owns when
+// it is not NULL, the way vm_run does
+lval* lval_eval_sexpr(lenv* e, lval* v, lenv* frame) {
+  GC_FRAME;
+  GC_ROOT(v);
+  if (frame) { gc_push_env(frame); }
+  lval* r;
+
+  for (;;) {
+    r = lval_eval_step(e, v);
+    if (r != &tail_call) { break; }
+
+    // Carry on with the expression in tail position
+    frame = lval_tail_frame(frame);
+    e = tail.env;
+    v = tail.expr;
+  }
 
-  lval* x = lval_take(a, 0);
-  x->type = LVAL_SEXPR;
-  return lval_eval(e, x);
+  if (frame) {
+    gc_pop_env();
+    lenv_del(frame);
+  }
+  GC_RETURN(r);
 }
 
-lval* builtin_join(lenv* e, lval* a) {
+// ### BYTECODE ###
+
+// An S-expression is compiled the first time the VM evaluates it. Its
+// children are pushed on the operand stack in order, symbols looked up
+// and nested S-expressions evaluated in place, then a call applies the
+// function to the arguments above it. The call ending the expression
+// is a tail call. An 'if' with two literal branches is compiled to
+// jumps, checked at run time in case 'if' was rebound.
+//
+// Constants are values the expression contains, so compiled code stays
+// valid as long as the expression, which is shared and never changes.
+
+enum {
+  OP_CONST,     // k    push constant k
+  OP_LOOKUP,    // k    push the value of symbol constant k
+  OP_EMPTY,     //      push a new empty S-expression
+  OP_CALL,      // n    apply the function below n arguments, push result
+  OP_TAILCALL,  // n    the same, ending the expression
+  OP_RETURN,    //      the value on top is the result
+  OP_IF,        // g f  unless builtin 'if' and a number are on top jump
+                //      to g, otherwise pop them and jump to f on zero
+  OP_JUMP,      // t    continue at t
+
+  // Superinstructions for the most common sequences
+  OP_LOOKUP_CONST,  // k j  OP_LOOKUP k then OP_CONST j
+  OP_ARITH,         // o    OP_CALL 2 of vm_arith[o], computed in place
+                    //      when it is the builtin and both are numbers
+};
+
+// Build with -DTYSON_THREADED=0 to dispatch with a switch instead of
+// jumping through a table of label addresses
+#ifndef TYSON_THREADED
+#if defined(__GNUC__) || defined(__clang__)
+#define TYSON_THREADED 1
+#else
+#define TYSON_THREADED 0
+#endif
+#endif
+
+// Hot functions are compiled to native code on x86-64 Linux, build
+// with -DTYSON_JIT=0 to leave them to the VM
+#ifndef TYSON_JIT
+#if defined(__x86_64__) && defined(__linux__)
+#define TYSON_JIT 1
+#else
+#define TYSON_JIT 0
+#endif
+#endif
+
+typedef struct ljit ljit;
+lval* jit_call(lval* f, lval** args, int n);
+void jit_del(ljit* j);
+
+// Builtins the VM applies to two numbers itself
+typedef struct {
+  char* name;
+  lbuiltin builtin;
+  // Interned name, set on first use
+  char* sym;
+} vm_arith_op;
+
+#define VM_ARITH_OP(n, N, s, k, r) { s, builtin_##n },
+vm_arith_op vm_arith[ARITH_COUNT] = { LVAL_NUM_OPS(VM_ARITH_OP) };
+
+struct lcode {
+  int* ops;
+  int count;
+  int max;
+  // Start of the last instruction, for combining it with the next
+  int last;
+  lval** consts;
+  int nconsts;
+  int maxconsts;
+  // Calls of the function this is the body of, and its native code
+  int calls;
+  ljit* jit;
+};
+
+void lcode_del(lcode* c) {
+#if TYSON_JIT
+  if (c->jit) { jit_del(c->jit); }
+#endif
+  free(c->ops);
+  free(c->consts);
+  free(c);
+}
+
+void gc_promote_code(lcode* c) {
+  for (int i = 0; i < c->nconsts; i++) {
+    gc_promote(&c->consts[i]);
+  }
+}
+
+void lcode_emit(lcode* c, int op) {
+  if (c->count == c->max) {
+    c->max = c->max ? c->max * 2 : 16;
+    c->ops = realloc(c->ops, sizeof(int) * c->max);
+  }
+  c->ops[c->count++] = op;
+}
+
+// Start a new instruction
+void lcode_op(lcode* c, int op) {
+  c->last = c->count;
+  lcode_emit(c, op);
+}
+
+int lcode_const(lcode* c, lval* v) {
+  if (c->nconsts == c->maxconsts) {
+    c->maxconsts = c->maxconsts ? c->maxconsts * 2 : 8;
+    c->consts = realloc(c->consts, sizeof(lval*) * c->maxconsts);
+  }
+  c->consts[c->nconsts] = v;
+  return c->nconsts++;
+}
+
+void lcode_sexpr(lcode* c, lval* v, int tail);
+
+// Code pushing the value of x
+void lcode_expr(lcode* c, lval* x) {
+  switch (lval_type(x)) {
+    case LVAL_SYM:
+      lcode_op(c, OP_LOOKUP);
+      lcode_emit(c, lcode_const(c, x));
+    break;
+    case LVAL_SEXPR:
+      lcode_sexpr(c, x, 0);
+    break;
+    default:
+      // Jumps never land right after a lookup, so the two combine
+      if (c->count && c->ops[c->last] == OP_LOOKUP) {
+        c->ops[c->last] = OP_LOOKUP_CONST;
+      } else {
+        lcode_op(c, OP_CONST);
+      }
+      lcode_emit(c, lcode_const(c, x));
+    break;
+  }
+}
+
+// Code for (if c {t} {f}), falling back to calling whatever 'if' is
+void lcode_if(lcode* c, lval* v, int tail) {
+  lcode_expr(c, v->cell[0]);
+  lcode_expr(c, v->cell[1]);
+  lcode_op(c, OP_IF);
+  int ops = c->count;
+  lcode_emit(c, 0);
+  lcode_emit(c, 0);
+
+  // Branches return on their own in tail position
+  lcode_sexpr(c, v->cell[2], tail);
+  int then_end = c->count;
+  if (!tail) { lcode_op(c, OP_JUMP); lcode_emit(c, 0); }
+
+  c->ops[ops+1] = c->count;
+  lcode_sexpr(c, v->cell[3], tail);
+  int else_end = c->count;
+  if (!tail) { lcode_op(c, OP_JUMP); lcode_emit(c, 0); }
+
+  c->ops[ops] = c->count;
+  lcode_expr(c, v->cell[2]);
+  lcode_expr(c, v->cell[3]);
+  lcode_op(c, tail ? OP_TAILCALL : OP_CALL);
+  lcode_emit(c, 3);
+
+  if (!tail) {
+    c->ops[then_end+1] = c->count;
+    c->ops[else_end+1] = c->count;
+  }
+}
 
-  for (int i = 0; i < a->count; i++)
-  {
-    LASSERT(a, a->cell[i]->type == LVAL_QEXPR, "Function 'join' passed incorrect type!");
+// Code evaluating v as an S-expression, the result is returned in
+// tail position and pushed otherwise
+void lcode_sexpr(lcode* c, lval* v, int tail) {
+  if (v->count == 4 && lval_type(v->cell[0]) == LVAL_SYM &&
+    v->cell[0]->sym == sym_if &&
+    lval_type(v->cell[2]) == LVAL_QEXPR &&
+    lval_type(v->cell[3]) == LVAL_QEXPR) {
+    lcode_if(c, v, tail);
+    return;
   }
 
-  lval* x = lval_pop(a, 0);
+  if (v->count > 1) {
+    for (int i = 0; i < v->count; i++) {
+      lcode_expr(c, v->cell[i]);
+    }
+
+    // Arithmetic on two arguments, except in tail position where a
+    // rebound operator must still be tail called
+    if (!tail && v->count == 3 && lval_type(v->cell[0]) == LVAL_SYM) {
+      for (int o = 0; o < ARITH_COUNT; o++) {
+        if (!vm_arith[o].sym) { vm_arith[o].sym = sym_intern(vm_arith[o].name); }
+        if (v->cell[0]->sym == vm_arith[o].sym) {
+          lcode_op(c, OP_ARITH);
+          lcode_emit(c, o);
+          return;
+        }
+      }
+    }
 
-  while (a->count) {
-    x = lval_join(x, lval_pop(a, 0));
+    lcode_op(c, tail ? OP_TAILCALL : OP_CALL);
+    lcode_emit(c, v->count - 1);
+    return;
   }
 
-  lval_del(a);
-  return x;
+  // Empty and single expressions, no call
+  if (v->count == 0) {
+    lcode_op(c, OP_EMPTY);
+  } else {
+    lcode_expr(c, v->cell[0]);
+  }
+  if (tail) { lcode_op(c, OP_RETURN); }
 }
 
+// Bytecode evaluating v, compiled on first use
+lcode* lval_compile(lval* v) {
+  if (v->code) { return v->code; }
 
-lval* builtin_var(lenv* e, lval* a, char* func) {
-  LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+  lcode* c = calloc(1, sizeof(lcode));
+  lcode_sexpr(c, v, 1);
+  v->code = c;
 
-  lval* syms = a->cell[0];
-  for (int i = 0; i < syms->count; i++) {
-    LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
-    "Function '%s' cannot define non-symbol. "
-    "Got %s, Expected %s.", func,
-    ltype_name(syms->cell[i]->type),
-    ltype_name(LVAL_SYM));
+  // The constants are now stored in v
+  for (int i = 0; i < c->nconsts; i++) {
+    gc_write_barrier(v, c->consts[i]);
   }
+  return c;
+}
 
-  LASSERT(a, (syms->count == a->count -1),
-    "Function '%s' passed too many arguments for Symbols. ",
-    "Got %i, Expected %i.", func, syms->count, a->count-1);
+static inline void vm_push(lval* x) {
+  gc_stack_push(&vm_stack, x);
+}
 
-  for (int i = 0; i < syms->count; i++) {
-    // If 'def' define it in global, if 'put' define it in local env
-    if (strcmp(func, "def") == 0) {
-      lenv_def(e, syms->cell[i], a->cell[i+1]);
-    }
+// Apply the function below the top n values of the stack to them
+lval* vm_call(lenv* e, int n) {
+  // Everything live is on the stack
+  gc_maybe();
+
+  lval** s = &vm_stack.items[vm_stack.count - n - 1];
+  lval* f = s[0];
 
-    if (strcmp(func, "=")   == 0) {
-      lenv_put(e, syms->cell[i], a->cell[i+1]);
+  // Error checking
+  lval* r = NULL;
+  if (lval_type(f) == LVAL_ERR) { r = f; }
+  for (int i = 1; !r && i <= n; i++) {
+    if (lval_type(s[i]) == LVAL_ERR) { r = s[i]; }
+  }
+  if (!r && lval_type(f) != LVAL_FUN && lval_type(f) != LVAL_PART) {
+    r = lval_err(
+      "S-Expression starts with incorrect type. "
+      "Got %s, Expected %s",
+      ltype_name(lval_type(f)), ltype_name(LVAL_FUN));
+  }
+  if (r) {
+    vm_stack.count -= n + 1;
+    return r;
+  }
+
+#if TYSON_JIT
+  // Hot functions run as native code while their guards hold
+  if (lval_type(f) == LVAL_FUN && !f->builtin &&
+    !(f->flags & LVAL_MACRO)) {
+    r = jit_call(f, s + 1, n);
+    if (r) {
+      vm_stack.count -= n + 1;
+      return r;
     }
   }
+#endif
+
+  // Arguments are passed as a new S-expression, which stays on the
+  // stack above the function during the call
+  lval* a = lval_sexpr();
+  lval_reserve(a, n);
+  a->count = n;
+  memcpy(a->cell, s + 1, sizeof(lval*) * n);
+  vm_stack.count -= n;
+  vm_push(a);
+
+  r = lval_call(e, f, a);
+  vm_stack.count -= 2;
+  return r;
+}
 
-  lval_del(a);
-  return lval_sexpr();
+// Result of a builtin in vm_arith on two numbers, overflow wraps
+#define VM_ARITH_CASE(n, N, s, k, r) case ARITH_##N: return r;
+static inline long vm_arith_apply(int o, long x, long y) {
+  switch (o) {
+    LVAL_NUM_OPS(VM_ARITH_CASE)
+    default: return 0;
+  }
 }
 
-lval* lval_call(lenv* e, lval* f, lval* a) {
-  // If builtin call it
-  if (f->builtin) {
-    return f->builtin(e, a);
+// Index of builtin f in vm_arith, or -1
+int vm_arith_index(lval* f) {
+  if (lval_type(f) != LVAL_FUN || !f->builtin) { return -1; }
+  for (int o = 0; o < ARITH_COUNT; o++) {
+    if (f->builtin == vm_arith[o].builtin) { return o; }
   }
+  return -1;
+}
 
-  // Record argument counts 
-  int given = a->count;
-  int total = f->formals->count;
-
-  // While arguments still remain
-  while (a->count) {
-    // If we've run out of arguments to bind
-    if (f->formals->count == 0) {
-      lval_del(a);
-      return lval_err(
-        "Function passed too many arguments. "
-        "Got %i, Expected %i.", given, total);
+// Result of a builtin calling f on the arguments in a, with its tail
+// call run to the end. Functions only bind the arguments, so the
+// caller may reuse a. A builtin can change or return its arguments
+// and gets a copy, unless it is arithmetic on two numbers.
+lval* lval_callback(lenv* e, lval* f, lval* a) {
+  lval* r;
+  if (lval_type(f) == LVAL_FUN && f->builtin) {
+    int o = vm_arith_index(f);
+    if (o >= 0 && a->count == 2 &&
+      lval_type(a->cell[0]) == LVAL_NUM && lval_type(a->cell[1]) == LVAL_NUM &&
+      (o != ARITH_DIV || lval_num_value(a->cell[1]) != 0)) {
+      return lval_num(vm_arith_apply(o,
+        lval_num_value(a->cell[0]), lval_num_value(a->cell[1])));
     }
+    lval* b = lval_sexpr();
+    r = f->builtin(e, lval_join(b, a));
+  } else {
+    r = lval_call(e, f, a);
+  }
 
-    // Pop first Symbol from formals
-    lval* sym = lval_pop(f->formals, 0);
-
-    // Special case dealing with '&'
-    if (strcmp(sym->sym, "&") == 0) {
-      // Make sure '&' is followed by Symbol
-      if (f->formals->count != 1) {
-        lval_del(a);
-        return lval_err("Function format invalid. "
-        "Symbol '&' not followed by single symbol.");
-      }
+  if (r != &tail_call) { return r; }
+  lenv* frame = tail.frame ? tail.env : NULL;
+  if (lval_interp == INTERP_VM) { return vm_run(tail.env, tail.expr, frame); }
+  return lval_eval_sexpr(tail.env, tail.expr, frame);
+}
 
-      // Next formal should be bound to remaining arguments
-      lval* next_sym = lval_pop(f->formals, 0);
-      lenv_put(f->env, next_sym, builtin_list(e, a));
-      lval_del(sym);
-      lval_del(next_sym);
-      break;
+// Instructions are labels with threaded dispatch and switch cases
+// otherwise. Each one ends by dispatching the next with VM_NEXT.
+#if TYSON_THREADED
+#define VM_DISPATCH  goto *vm_labels[ops[pc]];
+#define VM_CASE(op)  L_##op
+#define VM_NEXT      goto *vm_labels[ops[pc]]
+#else
+#define VM_DISPATCH  for (;;) switch (ops[pc])
+#define VM_CASE(op)  case op
+#define VM_NEXT      continue
+#endif
+
+lval* vm_run(lenv* e, lval* v, lenv* frame) {
+#if TYSON_THREADED
+  static void* vm_labels[] = {
+    [OP_CONST]        = &&L_OP_CONST,
+    [OP_LOOKUP]       = &&L_OP_LOOKUP,
+    [OP_EMPTY]        = &&L_OP_EMPTY,
+    [OP_CALL]         = &&L_OP_CALL,
+    [OP_TAILCALL]     = &&L_OP_TAILCALL,
+    [OP_RETURN]       = &&L_OP_RETURN,
+    [OP_IF]           = &&L_OP_IF,
+    [OP_JUMP]         = &&L_OP_JUMP,
+    [OP_LOOKUP_CONST] = &&L_OP_LOOKUP_CONST,
+    [OP_ARITH]        = &&L_OP_ARITH,
+  };
+#endif
+
+  GC_FRAME;
+  GC_ROOT(v);
+  if (frame) { gc_push_env(frame); }
+  lval* r = NULL;
+
+  for (;;) {
+    // Expressions built while running are evaluated once, walk those
+    if ((v->flags & LVAL_VIEW) || (!v->code && !lval_shared(v))) {
+      r = lval_eval_step(e, v);
+      goto next;
     }
 
+    gc_maybe();
+
+    lcode* c = lval_compile(v);
+    int* ops = c->ops;
+    int pc = 0;
+
+    // Dispatch until the expression returns or makes its tail call
+    VM_DISPATCH {
+      VM_CASE(OP_CONST):
+        vm_push(c->consts[ops[pc+1]]);
+        pc += 2;
+      VM_NEXT;
+      VM_CASE(OP_LOOKUP):
+        vm_push(lenv_get(e, c->consts[ops[pc+1]]));
+        pc += 2;
+      VM_NEXT;
+      VM_CASE(OP_LOOKUP_CONST):
+        vm_push(lenv_get(e, c->consts[ops[pc+1]]));
+        vm_push(c->consts[ops[pc+2]]);
+        pc += 3;
+      VM_NEXT;
+      VM_CASE(OP_EMPTY):
+        vm_push(lval_sexpr());
+        pc += 1;
+      VM_NEXT;
+      VM_CASE(OP_ARITH): {
+        lval** s = &vm_stack.items[vm_stack.count-3];
+        int o = ops[pc+1];
+        if (lval_type(s[0]) == LVAL_FUN && s[0]->builtin == vm_arith[o].builtin &&
+          lval_type(s[1]) == LVAL_NUM && lval_type(s[2]) == LVAL_NUM &&
+          (o != ARITH_DIV || lval_num_value(s[2]) != 0)) {
+          long x = vm_arith_apply(o, lval_num_value(s[1]), lval_num_value(s[2]));
+          vm_stack.count -= 3;
+          vm_push(lval_num(x));
+          pc += 2;
+          VM_NEXT;
+        }
+      }
+      // Not the builtin, call whatever it is
+      goto call;
+      VM_CASE(OP_CALL):
+      call:
+        r = vm_call(e, ops[pc] == OP_ARITH ? 2 : ops[pc+1]);
+        if (r == &tail_call) {
+          r = vm_run(tail.env, tail.expr, tail.frame ? tail.env : NULL);
+        }
+        vm_push(r);
+        pc += 2;
+      VM_NEXT;
+      VM_CASE(OP_TAILCALL):
+        r = vm_call(e, ops[pc+1]);
+      goto next;
+      VM_CASE(OP_RETURN):
+        r = vm_stack.items[--vm_stack.count];
+      goto next;
+      VM_CASE(OP_IF): {
+        lval* f = vm_stack.items[vm_stack.count-2];
+        lval* x = vm_stack.items[vm_stack.count-1];
+        if (lval_type(f) == LVAL_FUN && f->builtin == builtin_if &&
+          lval_type(x) == LVAL_NUM) {
+          vm_stack.count -= 2;
+          pc = lval_num_value(x) ? pc + 3 : ops[pc+2];
+        } else {
+          pc = ops[pc+1];
+        }
+      }
+      VM_NEXT;
+      VM_CASE(OP_JUMP):
+        pc = ops[pc+1];
+      VM_NEXT;
+    }
 
-    // Pop next argument from list
-    lval* val = lval_pop(a, 0);
+  next:
+    if (r != &tail_call) { break; }
 
-    // Bind a copy to func env
-    lenv_put(f->env, sym, val);
+    // Carry on with the expression in tail position
+    frame = lval_tail_frame(frame);
+    e = tail.env;
+    v = tail.expr;
+  }
 
-    // Delete Symbol and Value
-    lval_del(sym);
-    lval_del(val);
+  if (frame) {
+    gc_pop_env();
+    lenv_del(frame);
   }
-  // Argument list is now bound
-  // Cleaning up
-  lval_del(a);
+  GC_RETURN(r);
+}
 
-  // If '&' remains in formal list bind to empty list
-  if (f->formals->count > 0 &&
-    strcmp(f->formals->cell[0]->sym, "&") == 0) {
-      // Check if passed incorrectly
-      if (f->formals->count != 2) {
-        return lval_err("Function format invald. "
-        "Symbol '&' not followed by single symbol");
-      }
-      
-      // Pop and delete '&'
-      lval_del(lval_pop(f->formals, 0));
+// ### OPTIMIZER ###
+
+// Programs loaded with 'load' into the global environment are
+// simplified one top-level form at a time, after macros are expanded
+// and before the form is evaluated. In its S-expressions the pass
+//  - replaces arithmetic and comparisons on literal numbers with the
+//    result,
+//  - replaces an 'if' on a literal number with the branch it takes.
+// Q-expressions are left as they were read. Bodies and branches
+// outlive the load, and whatever the builtins are bound to when they
+// run is checked by the VM's OP_ARITH and OP_IF instead.
+//
+// Globals are never replaced by their values. Scoping is dynamic and
+// 'def' can run inside any function, so a value seen while loading
+// says nothing about the value when the code runs. Only the builtins
+// themselves are taken as fixed, and only in forms where nothing else
+// runs that could rebind them, see lopt_closed.
+
+// See --optimize and --dump-optimized
+int opt_enabled = 1;
+int opt_dump = 0;
+
+// Bindings of one name in a file, and the top-level form that is its
+// only binding if it is a 'def'
+typedef struct {
+  char* sym;
+  int count;
+  int def;
+} lopt_binding;
 
-      // Pop next Symbol and create empty list
-      lval* sym = lval_pop(f->formals, 0);
-      lval* val = lval_qexpr();
+struct lopt {
+  lopt_binding* binds;
+  int count;
+  int max;
+  // Top-level form being optimized
+  int form;
+};
 
-      // Bind to enviroment and delete
-      lenv_put(f->env, sym, val);
-      lval_del(sym);
-      lval_del(val);
+// Record the names v binds, form is v's index if it is top-level
+void lopt_scan(lopt* o, lval* v, int form) {
+  if (lval_type(v) != LVAL_SEXPR && lval_type(v) != LVAL_QEXPR) { return; }
+
+  if (lval_binds(v)) {
+    int def = (form >= 0 && v->cell[0]->sym == sym_def) ? form : -1;
+    lval* syms = v->cell[1];
+    for (int i = 0; i < syms->count; i++) {
+      if (lval_type(syms->cell[i]) != LVAL_SYM) { continue; }
+      if (syms->cell[i]->sym == sym_amp) { continue; }
+      if (o->count == o->max) {
+        o->max = o->max ? 2 * o->max : 64;
+        o->binds = realloc(o->binds, sizeof(lopt_binding) * o->max);
+      }
+      o->binds[o->count++] = (lopt_binding){ syms->cell[i]->sym, 1, def };
     }
+  }
 
+  for (int i = 0; i < v->count; i++) {
+    lopt_scan(o, v->cell[i], -1);
+  }
+}
 
+int lopt_cmp(const void* a, const void* b) {
+  uintptr_t x = (uintptr_t)((lopt_binding*)a)->sym;
+  uintptr_t y = (uintptr_t)((lopt_binding*)b)->sym;
+  return (x > y) - (x < y);
+}
 
-  // If all formals have been bound evaluate
-  if (f->formals->count == 0) {
-    // Set parent enviornment
-    f->env->par = e;
+// Optimizer for the top-level forms in list forms, or NULL if disabled
+lopt* lopt_new(lval* forms) {
+  if (!opt_enabled) { return NULL; }
+  lopt* o = calloc(1, sizeof(lopt));
+  for (int i = 0; i < forms->count; i++) {
+    lopt_scan(o, forms->cell[i], i);
+  }
 
-    // Evaluate body and return
-    return builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
-  } else {
-    // Else return partially evaluated function
-    return lval_copy(f);
+  // Sort by name and merge the bindings of each
+  qsort(o->binds, o->count, sizeof(lopt_binding), lopt_cmp);
+  int n = 0;
+  for (int i = 0; i < o->count; i++) {
+    if (n && o->binds[n-1].sym == o->binds[i].sym) {
+      o->binds[n-1].count++;
+      o->binds[n-1].def = -1;
+    } else {
+      o->binds[n++] = o->binds[i];
+    }
   }
+  o->count = n;
+  return o;
 }
 
-lval* builtin_def(lenv* e, lval* a) {
-  return builtin_var(e, a, "def");
+void lopt_del(lopt* o) {
+  if (!o) { return; }
+  free(o->binds);
+  free(o);
 }
 
-lval* builtin_put(lenv* e, lval* a) {
-  return builtin_var(e, a, "=");
+// Value of global sym if the form being optimized may take it as
+// constant, otherwise NULL
+lval* lopt_global(lopt* o, char* sym) {
+  lopt_binding key = { sym, 0, 0 };
+  lopt_binding* b = o->count == 0 ? NULL : bsearch(&key, o->binds, o->count,
+    sizeof(lopt_binding), lopt_cmp);
+  if (b && (b->count > 1 || b->def < 0 || b->def >= o->form)) {
+    return NULL;
+  }
+  int i = lenv_find(lenv_root, sym);
+  return i < 0 ? NULL : lenv_root->vals[i];
 }
 
-lval* builtin_lambda(lenv* e, lval* a) {
-  // Check arguments
-  LASSERT_NUM("\\", a, 2);
-  LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
-  LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
+// The builtin x names as a constant, or NULL
+lbuiltin lopt_builtin(lopt* o, lval* x) {
+  if (lval_type(x) != LVAL_SYM) { return NULL; }
+  lval* f = lopt_global(o, x->sym);
+  if (!f || lval_type(f) != LVAL_FUN) { return NULL; }
+  return f->builtin;
+}
 
-  // Check first Q-expression for Symbols
-  for (int i = 0; i < a->cell[0]->count; i++) {
-    LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
-    "Cannot define non-symbol. Got %s, Expected %s.",
-    ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+// Whether v is made of builtins lopt_global takes as constant, other
+// than 'load', and of the names a 'def' or '=' in it binds, written out
+// as a Q-expression. No other code can run while such a form is
+// evaluated, so nothing rebinds the builtins it calls.
+int lopt_closed(lopt* o, lval* v) {
+  switch (lval_type(v)) {
+    case LVAL_SYM: {
+      lval* f = lopt_global(o, v->sym);
+      return f && lval_type(f) == LVAL_FUN && f->builtin &&
+        f->builtin != builtin_load;
+    }
+    case LVAL_SEXPR:
+    case LVAL_QEXPR: {
+      int names = v->count && lval_type(v->cell[0]) == LVAL_SYM &&
+        (v->cell[0]->sym == sym_def || v->cell[0]->sym == sym_put);
+      if (names && (v->count < 2 || lval_type(v->cell[1]) != LVAL_QEXPR)) {
+        return 0;
+      }
+      for (int i = 0; i < v->count; i++) {
+        if (names && i == 1) { continue; }
+        if (!lopt_closed(o, v->cell[i])) { return 0; }
+      }
+      return 1;
+    }
   }
+  return 1;
+}
 
-  // Pop two arguments and pass to lval lambda
-  lval* formals = lval_pop(a, 0);
-  lval* body = lval_pop(a,0);
-  lval_del(a);
+lval* lopt_code(lopt* o, lval* v);
 
-  return lval_lambda(formals, body);
+// Optimized element x of code
+lval* lopt_elem(lopt* o, lval* x) {
+  if (lval_type(x) == LVAL_SEXPR) { return lopt_code(o, x); }
+  return x;
 }
 
-lval* builtin_ord(lenv* e, lval* a, char* op) {
-  LASSERT_NUM(op, a, 2);
-  LASSERT_TYPE(op, a, 0, LVAL_NUM);
-  LASSERT_TYPE(op, a, 1, LVAL_NUM);
-
+// An S-expression of a single value evaluates to the value
+lval* lopt_unwrap(lval* v) {
+  if (lval_type(v) != LVAL_SEXPR || v->count != 1) { return v; }
+  int t = lval_type(v->cell[0]);
+  if (t == LVAL_NUM || t == LVAL_STR || t == LVAL_QEXPR) { return v->cell[0]; }
+  return v;
+}
 
-  int r;
-  if (strcmp(op, ">") == 0) {
-    r = (a->cell[0]->num >  a->cell[1]->num);
-  }
+// Optimized code list v
+lval* lopt_code(lopt* o, lval* v) {
+  lbuiltin b = v->count ? lopt_builtin(o, v->cell[0]) : NULL;
 
-  if (strcmp(op, "<") == 0) {
-    r = (a->cell[0]->num <  a->cell[1]->num);
+  for (int i = 0; i < v->count; i++) {
+    lval* x = lopt_elem(o, v->cell[i]);
+    v->cell[i] = x;
+    gc_write_barrier(v, x);
   }
 
-  if (strcmp(op, ">=") == 0) {
-    r = (a->cell[0]->num >=  a->cell[1]->num);
+  // Arithmetic and comparisons on numbers, unless they fail
+  int arith = b && vm_arith_index(lopt_global(o, v->cell[0]->sym)) >= 0;
+  if (arith && v->count > 1) {
+    int nums = 1;
+    for (int i = 1; i < v->count; i++) {
+      if (lval_type(v->cell[i]) != LVAL_NUM) { nums = 0; }
+    }
+    if (nums) {
+      lval* a = lval_sexpr();
+      lval_reserve(a, v->count - 1);
+      a->count = v->count - 1;
+      memcpy(a->cell, v->cell + 1, sizeof(lval*) * a->count);
+      lval* r = b(lenv_root, a);
+      if (lval_type(r) == LVAL_NUM) {
+        return r;
+      }
+    }
   }
 
-  if (strcmp(op, "<=") == 0) {
-    r = (a->cell[0]->num <=  a->cell[1]->num);
+  // An 'if' on a number is the branch it takes
+  if (b == builtin_if && v->count == 4 && lval_type(v->cell[1]) == LVAL_NUM &&
+    lval_type(v->cell[2]) == LVAL_QEXPR && lval_type(v->cell[3]) == LVAL_QEXPR) {
+    // The branch is left as it was read, its cells go in a new list
+    lval* x = lval_num_value(v->cell[1]) ? v->cell[2] : v->cell[3];
+    return lopt_code(o, lval_join(lval_sexpr(), x));
   }
-  lval_del(a);
-  return lval_num(r);
-  }
-
-lval* builtin_gt(lenv* e, lval* a) {
-  return builtin_ord(e, a, ">");
-}
 
-lval* builtin_lt(lenv* e, lval* a) {
-  return builtin_ord(e, a, "<");
+  return lopt_unwrap(v);
 }
 
-lval* builtin_ge(lenv* e, lval* a) {
-  return builtin_ord(e, a, ">=");
+// Optimize v, the form'th top-level form of the file
+lval* lval_optimize(lopt* o, lval* v, int form) {
+  if (o) {
+    o->form = form;
+    if (lopt_closed(o, v)) { v = lopt_elem(o, v); }
+  }
+  if (opt_dump) { lval_println(v); }
+  return v;
 }
 
-lval* builtin_le(lenv* e, lval* a) {
-  return builtin_ord(e, a, "<=");
-}
+// ### JIT ###
+
+// Once a function has been called JIT_THRESHOLD times through the VM,
+// its body is compiled to x86-64 code if it only uses numbers, its
+// formals, the arithmetic and comparison builtins, 'if' and calls to
+// itself. Native code keeps plain longs on the machine stack and calls
+// itself directly, tail calls to itself become jumps.
+//
+// It is only entered when the arguments are numbers and each other
+// symbol in the body is unshadowed and still bound to what it was at
+// compile time in the root environment. Nothing it does can change
+// that, and it has no side effects, so when arithmetic overflows it
+// abandons the call and the VM evaluates it again from the start.
+
+#if TYSON_JIT
+
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 100
+#endif
+
+// Most formals a compiled function can have
+#define JIT_MAX_ARGS 8
+
+// See --jit
+int jit_enabled = 1;
+
+struct ljit {
+  long (*entry)(long* args);
+  void* mem;
+  size_t size;
+
+  // Formals compiled for, the body can be shared by other functions
+  char* formals[JIT_MAX_ARGS];
+  int nformals;
+
+  // Symbols checked on entry, with the builtin each must be bound to
+  // or NULL for the function itself
+  char** guards;
+  lbuiltin* builtins;
+  int nguards;
+};
 
-int lval_eq(lval* x, lval* y) {
-  // Different Types are always unequal
-  if (x->type != y->type) { return 0; }
+// Marks a body that cannot be compiled
+ljit jit_failed;
 
-  // Compare Base upon type
-  switch (x->type) {
-    // Compare Number Value
-    case LVAL_NUM: return (x->num == y->num);
+void jit_del(ljit* j) {
+  if (j == &jit_failed) { return; }
+  munmap(j->mem, j->size);
+  free(j->guards);
+  free(j->builtins);
+  free(j);
+}
 
-    // Compare String Values
-    case LVAL_ERR: return (strcmp(x->err, y->err) == 0);
-    case LVAL_SYM: return (strcmp(x->sym, y->sym) == 0);
-    case LVAL_STR: return (strcmp(x->str, y->str) == 0);
+// Where native code returns to when it gives up
+jmp_buf jit_bail_env;
 
-    // If builtin compare, otherwise compare formals and body
-    case LVAL_FUN:
-      if (x->builtin || y->builtin) {
-        return x->builtin == y->builtin;
-      } else {
-        return lval_eq(x->formals, y->formals)
-        && lval_eq(x->body, y->body);
-      }
+void jit_bail(void) {
+  longjmp(jit_bail_env, 1);
+}
 
-    // If list compare every individual element
-    case LVAL_QEXPR:
-    case LVAL_SEXPR:
-      if (x->count != y->count) { return 0; }
-      for (int i = 0; i < x->count; i++) {
-        // If any element is not equal return not equal
-        if (!lval_eq(x->cell[i], y->cell[i])) { return 0; }
-      }
-      // Otherwise lists are equal
-      return 1;
-    break;
+typedef struct {
+  unsigned char* buf;
+  int count;
+  int max;
+  int fail;
+  lval* f;
+  ljit* j;
+  // Start of the body function and of its code after the prologue
+  int body;
+  int loop;
+} jit_asm;
+
+void jit_emit(jit_asm* ja, int n, ...) {
+  if (ja->count + n > ja->max) {
+    ja->max = ja->max ? ja->max * 2 : 256;
+    while (ja->count + n > ja->max) { ja->max *= 2; }
+    ja->buf = realloc(ja->buf, ja->max);
   }
-  return 0;
+  va_list va;
+  va_start(va, n);
+  for (int i = 0; i < n; i++) {
+    ja->buf[ja->count++] = (unsigned char)va_arg(va, int);
+  }
+  va_end(va);
 }
 
-lval* builtin_cmp(lenv* e, lval* a, char* op) {
-  LASSERT_NUM(op, a, 2);
-  int r;
-  if (strcmp(op, "==") == 0) {
-    r =  lval_eq(a->cell[0], a->cell[1]);
-  }
+void jit_emit32(jit_asm* ja, int32_t x) {
+  for (int i = 0; i < 4; i++) { jit_emit(ja, 1, (x >> (8 * i)) & 0xff); }
+}
 
-  if (strcmp(op, "!=") == 0) {
-    r = !lval_eq(a->cell[0], a->cell[1]);
-  }
-  lval_del(a);
-  return lval_num(r);
+void jit_emit64(jit_asm* ja, int64_t x) {
+  for (int i = 0; i < 8; i++) { jit_emit(ja, 1, (int)((x >> (8 * i)) & 0xff)); }
 }
 
-lval* builtin_eq(lenv* e, lval* a) {
-  return builtin_cmp(e, a, "==");
+// Point the rel32 operand at offset at to target
+void jit_patch(jit_asm* ja, int at, int target) {
+  int32_t rel = target - (at + 4);
+  memcpy(ja->buf + at, &rel, 4);
 }
 
-lval* builtin_ne(lenv* e, lval* a) {
-  return builtin_cmp(e, a, "!=");
+// Emit a jump instruction with a rel32 operand to target, which may
+// still be unknown, and return the operand's offset
+int jit_jump(jit_asm* ja, int n, int op0, int op1, int target) {
+  jit_emit(ja, n, op0, op1);
+  int at = ja->count;
+  jit_emit32(ja, 0);
+  jit_patch(ja, at, target);
+  return at;
 }
 
-lval* builtin_if(lenv* e, lval* a) {
-  LASSERT_NUM("if", a, 3);
-  LASSERT_TYPE("if", a, 0, LVAL_NUM);
-  LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
-  LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
+// Offset of the argument slot of formal i relative to rbp
+static inline int32_t jit_arg(int i) {
+  return 16 + 8 * i;
+}
 
-  // Mark both Expressions as evaluable
-  lval* x;
-  a->cell[1]->type = LVAL_SEXPR;
-  a->cell[2]->type = LVAL_SEXPR;
+int jit_formal(jit_asm* ja, char* sym) {
+  for (int i = 0; i < ja->j->nformals; i++) {
+    if (ja->j->formals[i] == sym) { return i; }
+  }
+  return -1;
+}
 
-  if (a->cell[0]->num) {
-    // If condition is true eval first expression
-    x = lval_eval(e, lval_pop(a, 1));
-  } else {
-    // Otherwise eval second expression
-    x = lval_eval(e, lval_pop(a, 2));
+// What a symbol in call position is bound to in the root environment,
+// the function itself, builtin 'if' or one of vm_arith, which is
+// recorded as a guard. Returns -1 for the function itself, ARITH_COUNT
+// for 'if', the vm_arith index, or -2 if it cannot be compiled.
+int jit_callee(jit_asm* ja, char* sym) {
+  if (jit_formal(ja, sym) >= 0) { return -2; }
+  int i = lenv_find(lenv_root, sym);
+  if (i < 0) { return -2; }
+  lval* v = lenv_root->vals[i];
+  if (lval_type(v) != LVAL_FUN) { return -2; }
+
+  int kind = -2;
+  lbuiltin b = NULL;
+  if (v == ja->f) { kind = -1; }
+  if (v->builtin == builtin_if) { kind = ARITH_COUNT; b = builtin_if; }
+  for (int o = 0; o < ARITH_COUNT; o++) {
+    if (v->builtin == vm_arith[o].builtin) { kind = o; b = v->builtin; }
   }
+  if (kind == -2) { return -2; }
 
-  // Delete arguments and return
-  lval_del(a);
-  return x;
+  ljit* j = ja->j;
+  for (int g = 0; g < j->nguards; g++) {
+    if (j->guards[g] == sym) { return kind; }
+  }
+  j->nguards++;
+  j->guards = realloc(j->guards, sizeof(char*) * j->nguards);
+  j->builtins = realloc(j->builtins, sizeof(lbuiltin) * j->nguards);
+  j->guards[j->nguards-1] = sym;
+  j->builtins[j->nguards-1] = b;
+  return kind;
 }
 
-lval* lval_join(lval* x, lval* y) {
-  // For each cell in y, add it to x
-  while (y->count) {
-    x = lval_add(x, lval_pop(y, 0));
+void jit_sexpr(jit_asm* ja, lval* v, int tail);
+
+// Code leaving the value of x in rax
+void jit_expr(jit_asm* ja, lval* x, int tail) {
+  switch (lval_type(x)) {
+    case LVAL_NUM:
+      // movabs rax, imm64
+      jit_emit(ja, 2, 0x48, 0xb8);
+      jit_emit64(ja, lval_num_value(x));
+    break;
+    case LVAL_SYM: {
+      int i = jit_formal(ja, x->sym);
+      if (i < 0) { ja->fail = 1; return; }
+      // mov rax, [rbp+arg]
+      jit_emit(ja, 3, 0x48, 0x8b, 0x85);
+      jit_emit32(ja, jit_arg(i));
+    }
+    break;
+    case LVAL_SEXPR:
+      jit_sexpr(ja, x, tail);
+    break;
+    default:
+      ja->fail = 1;
+    break;
   }
+}
 
-  // Delete the empty y and return x
-  lval_del(y);
-  return x;
+// Code evaluating the elements from index 1 into rax and rcx in turn
+// and combining them with op, jumping to the bail stub at 0 on overflow
+void jit_fold(jit_asm* ja, lval* v, int b0, int b1, int b2, int b3) {
+  jit_expr(ja, v->cell[1], 0);
+  for (int i = 2; i < v->count; i++) {
+    // push rax
+    jit_emit(ja, 1, 0x50);
+    jit_expr(ja, v->cell[i], 0);
+    // mov rcx, rax; pop rax
+    jit_emit(ja, 4, 0x48, 0x89, 0xc1, 0x58);
+    if (b3 >= 0) {
+      jit_emit(ja, 4, b0, b1, b2, b3);
+    } else {
+      jit_emit(ja, 3, b0, b1, b2);
+    }
+    // jo bail
+    jit_jump(ja, 2, 0x0f, 0x80, 0);
+  }
 }
-lval* lval_copy(lval* v) {
-  lval* x = malloc(sizeof(lval));
-  x->type = v->type;
 
-  switch (v->type) {
+void jit_sexpr(jit_asm* ja, lval* v, int tail) {
+  if (ja->fail) { return; }
+  if (v->count == 0) { ja->fail = 1; return; }
+  if (v->count == 1) { jit_expr(ja, v->cell[0], tail); return; }
+  if (lval_type(v->cell[0]) != LVAL_SYM) { ja->fail = 1; return; }
+
+  int kind = jit_callee(ja, v->cell[0]->sym);
+  int n = v->count - 1;
+  switch (kind) {
+    case -2:
+      ja->fail = 1;
+    break;
 
-    // Copy functions and numbers
-    case LVAL_NUM: x->num = v->num; break;
-    case LVAL_FUN:
-      if (v->builtin) {
-        x->builtin = v->builtin;
+    // Call of the function itself
+    case -1: {
+      if (n != ja->j->nformals) { ja->fail = 1; return; }
+      if (tail) {
+        // Push the arguments, pop them into the argument slots and
+        // start over
+        for (int i = 1; i <= n; i++) {
+          jit_expr(ja, v->cell[i], 0);
+          jit_emit(ja, 1, 0x50);
+        }
+        for (int i = n - 1; i >= 0; i--) {
+          // pop rax; mov [rbp+arg], rax
+          jit_emit(ja, 4, 0x58, 0x48, 0x89, 0x85);
+          jit_emit32(ja, jit_arg(i));
+        }
+        // jmp loop
+        jit_emit(ja, 1, 0xe9);
+        int at = ja->count;
+        jit_emit32(ja, 0);
+        jit_patch(ja, at, ja->loop);
       } else {
-        x->builtin = NULL;
-        x->env = lenv_copy(v->env);
-        x->formals = lval_copy(v->formals);
-        x->body = lval_copy(v->body);
+        // Arguments are pushed last to first, call and drop them
+        for (int i = n; i >= 1; i--) {
+          jit_expr(ja, v->cell[i], 0);
+          jit_emit(ja, 1, 0x50);
+        }
+        jit_emit(ja, 1, 0xe8);
+        int at = ja->count;
+        jit_emit32(ja, 0);
+        jit_patch(ja, at, ja->body);
+        // add rsp, 8n
+        jit_emit(ja, 3, 0x48, 0x81, 0xc4);
+        jit_emit32(ja, 8 * n);
       }
+    }
     break;
 
-    // Copy error strings
-    case LVAL_ERR: x->err = malloc(strlen(v->err) + 1);
-      strcpy(x->err, v->err);
+    case ARITH_COUNT: {
+      if (n != 3 ||
+        lval_type(v->cell[2]) != LVAL_QEXPR ||
+        lval_type(v->cell[3]) != LVAL_QEXPR) {
+        ja->fail = 1;
+        return;
+      }
+      jit_expr(ja, v->cell[1], 0);
+      // test rax, rax; jz else
+      jit_emit(ja, 3, 0x48, 0x85, 0xc0);
+      int to_else = jit_jump(ja, 2, 0x0f, 0x84, 0);
+      jit_sexpr(ja, v->cell[2], tail);
+      // jmp end
+      jit_emit(ja, 1, 0xe9);
+      int to_end = ja->count;
+      jit_emit32(ja, 0);
+      jit_patch(ja, to_else, ja->count);
+      jit_sexpr(ja, v->cell[3], tail);
+      jit_patch(ja, to_end, ja->count);
+    }
     break;
 
-    // Copy symbol string
-    case LVAL_SYM: x->sym = malloc(strlen(v->sym) + 1);
-      strcpy(x->sym, v->sym);
+    case ARITH_ADD:
+      // add rax, rcx
+      jit_fold(ja, v, 0x48, 0x01, 0xc8, -1);
     break;
-    case LVAL_STR: x->str = malloc(strlen(v->str) + 1);
-      strcpy(x->str, v->str);
+    case ARITH_MUL:
+      // imul rax, rcx
+      jit_fold(ja, v, 0x48, 0x0f, 0xaf, 0xc1);
     break;
-    case LVAL_SEXPR:
-    case LVAL_QEXPR:
-      x->count = v->count;
-      x->cell = malloc(sizeof(lval*) * x->count);
-      for (int i = 0; i < x->count; i++) {
-        x->cell[i] = lval_copy(v->cell[i]);
+    case ARITH_SUB:
+      if (n == 1) {
+        // neg rax, jo bail
+        jit_expr(ja, v->cell[1], 0);
+        jit_emit(ja, 3, 0x48, 0xf7, 0xd8);
+        jit_jump(ja, 2, 0x0f, 0x80, 0);
+      } else {
+        // sub rax, rcx
+        jit_fold(ja, v, 0x48, 0x29, 0xc8, -1);
       }
     break;
-  }
-  return x;
-}
 
+    // Division may fail, leave it to the builtin
+    case ARITH_DIV:
+      ja->fail = 1;
+    break;
 
-lval* lval_builtin(lbuiltin func) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_FUN;
-  v->builtin = func;
-  return v;
-}
-
-void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
-  lval* k = lval_sym(name);
-  lval* v = lval_builtin(func);
-  lenv_put(e, k, v);
-  lval_del(k); lval_del(v);
+    // Comparisons
+    default: {
+      if (n != 2) { ja->fail = 1; return; }
+      int cc = 0;
+      switch (kind) {
+        case ARITH_GT: cc = 0x9f; break;
+        case ARITH_LT: cc = 0x9c; break;
+        case ARITH_GE: cc = 0x9d; break;
+        case ARITH_LE: cc = 0x9e; break;
+        case ARITH_EQ: cc = 0x94; break;
+        case ARITH_NE: cc = 0x95; break;
+      }
+      jit_expr(ja, v->cell[1], 0);
+      jit_emit(ja, 1, 0x50);
+      jit_expr(ja, v->cell[2], 0);
+      // mov rcx, rax; pop rax; cmp rax, rcx; setcc al; movzx eax, al
+      jit_emit(ja, 4, 0x48, 0x89, 0xc1, 0x58);
+      jit_emit(ja, 3, 0x48, 0x39, 0xc8);
+      jit_emit(ja, 3, 0x0f, cc, 0xc0);
+      jit_emit(ja, 3, 0x0f, 0xb6, 0xc0);
+    }
+    break;
+  }
 }
 
-void lenv_add_builtins(lenv* e) {
-  // List Functions
-  lenv_add_builtin(e, "list", builtin_list);
-  lenv_add_builtin(e, "head", builtin_head);
-  lenv_add_builtin(e, "tail", builtin_tail);
-  lenv_add_builtin(e, "eval", builtin_eval);
-  lenv_add_builtin(e, "join", builtin_join);
-  
-  // Mathematical Functions
-  lenv_add_builtin(e, "+", builtin_add);
-  lenv_add_builtin(e, "-", builtin_sub);
-  lenv_add_builtin(e, "*", builtin_mul);
-  lenv_add_builtin(e, "/", builtin_div);
+ljit* jit_compile(lval* f) {
+  lval* formals = f->formals;
+  if (formals->count > JIT_MAX_ARGS) { return &jit_failed; }
 
-  // Variable Functions
-  lenv_add_builtin(e, "\\",  builtin_lambda); 
-  lenv_add_builtin(e, "def", builtin_def);
-  lenv_add_builtin(e, "=",   builtin_put);
+  ljit* j = calloc(1, sizeof(ljit));
+  j->nformals = formals->count;
+  for (int i = 0; i < formals->count; i++) {
+    j->formals[i] = formals->cell[i]->sym;
+    if (j->formals[i] == sym_amp) { j->nformals = -1; }
+  }
 
-  // Comparison Functions
-  lenv_add_builtin(e, "if", builtin_if);
-  lenv_add_builtin(e, "==", builtin_eq);
-  lenv_add_builtin(e, "!=", builtin_ne);
-  lenv_add_builtin(e, ">", builtin_gt);
-  lenv_add_builtin(e, "<", builtin_lt);
-  lenv_add_builtin(e, ">=", builtin_ge);
-  lenv_add_builtin(e, "<=", builtin_le);
+  jit_asm ja = { NULL, 0, 0, j->nformals < 0, f, j, 0, 0 };
+
+  // Bail stub at 0: and rsp, -16; movabs rax, jit_bail; call rax
+  jit_emit(&ja, 4, 0x48, 0x83, 0xe4, 0xf0);
+  jit_emit(&ja, 2, 0x48, 0xb8);
+  jit_emit64(&ja, (int64_t)(intptr_t)jit_bail);
+  jit_emit(&ja, 2, 0xff, 0xd0);
+
+  // Entry from C with the arguments in an array pointed to by rdi:
+  // push rbp; mov rbp, rsp; push each argument last to first;
+  // call body; mov rsp, rbp; pop rbp; ret
+  int entry = ja.count;
+  jit_emit(&ja, 4, 0x55, 0x48, 0x89, 0xe5);
+  for (int i = j->nformals - 1; i >= 0; i--) {
+    // mov rax, [rdi+8i]; push rax
+    jit_emit(&ja, 3, 0x48, 0x8b, 0x87);
+    jit_emit32(&ja, 8 * i);
+    jit_emit(&ja, 1, 0x50);
+  }
+  jit_emit(&ja, 1, 0xe8);
+  int to_body = ja.count;
+  jit_emit32(&ja, 0);
+  jit_emit(&ja, 5, 0x48, 0x89, 0xec, 0x5d, 0xc3);
+
+  // Body: push rbp; mov rbp, rsp; value into rax; mov rsp, rbp;
+  // pop rbp; ret
+  ja.body = ja.count;
+  jit_patch(&ja, to_body, ja.body);
+  jit_emit(&ja, 4, 0x55, 0x48, 0x89, 0xe5);
+  ja.loop = ja.count;
+  if (!ja.fail) { jit_sexpr(&ja, f->body, 1); }
+  jit_emit(&ja, 5, 0x48, 0x89, 0xec, 0x5d, 0xc3);
+
+  // Copy into executable memory
+  if (!ja.fail) {
+    long page = sysconf(_SC_PAGESIZE);
+    j->size = (ja.count + page - 1) / page * page;
+    j->mem = mmap(NULL, j->size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (j->mem == MAP_FAILED) { ja.fail = 1; }
+  }
+  if (ja.fail) {
+    free(ja.buf);
+    free(j->guards);
+    free(j->builtins);
+    free(j);
+    return &jit_failed;
+  }
+  memcpy(j->mem, ja.buf, ja.count);
+  mprotect(j->mem, j->size, PROT_READ | PROT_EXEC);
+  free(ja.buf);
 
-  // String Functions
-  lenv_add_builtin(e, "load", builtin_load);
-  lenv_add_builtin(e, "error", builtin_error);
-  lenv_add_builtin(e, "print", builtin_print);
+  j->entry = (long (*)(long*))((char*)j->mem + entry);
+  return j;
 }
 
+// Result of calling f on n arguments with native code, or NULL when
+// it has to be evaluated as usual
+lval* jit_call(lval* f, lval** args, int n) {
+  lcode* c = f->body->code;
+  if (!jit_enabled || !c || n != f->formals->count) {
+    return NULL;
+  }
 
-lval* lval_eval(lenv* e, lval* v) {
-  if (v->type == LVAL_SYM) {
-    lval* x = lenv_get(e, v);
-    lval_del(v);
-    return x;
+  // Tier up once hot
+  if (!c->jit) {
+    if (++c->calls < JIT_THRESHOLD) { return NULL; }
+    c->jit = jit_compile(f);
   }
-  // Evaluate S-expression
-  if (v->type == LVAL_SEXPR) { return lval_eval_sexpr(e, v); }
-  // Other types remain the same
-  return v;
+  ljit* j = c->jit;
+  if (j == &jit_failed) { return NULL; }
+
+  // Guards
+  long in[JIT_MAX_ARGS];
+  for (int i = 0; i < n; i++) {
+    if (f->formals->cell[i]->sym != j->formals[i]) { return NULL; }
+    if (lval_type(args[i]) != LVAL_NUM) { return NULL; }
+    in[i] = lval_num_value(args[i]);
+  }
+  for (int g = 0; g < j->nguards; g++) {
+    char* sym = j->guards[g];
+    int i = lenv_find(lenv_root, sym);
+    if (sym_entry_of(sym)->frames || i < 0) { return NULL; }
+    lval* v = lenv_root->vals[i];
+    if (lval_type(v) != LVAL_FUN) { return NULL; }
+    if (j->builtins[g] ? v->builtin != j->builtins[g] : v != f) { return NULL; }
+  }
+
+  // Overflow, fall back to the VM for good
+  if (setjmp(jit_bail_env)) {
+    jit_del(j);
+    c->jit = &jit_failed;
+    return NULL;
+  }
+  return lval_num(j->entry(in));
 }
 
+#endif
 
+// ### PERFORMANCE COUNTERS ###
 
-lval* lval_eval_sexpr(lenv* e, lval* v) {
-  // Evaluating children
-  for (int i = 0; i < v->count; i++) {
-    v->cell[i] = lval_eval(e, v->cell[i]);
-  }
+// Hardware counters for the evaluation of the files given, read with
+// perf_event_open where available, see --perf-stats
+typedef struct {
+  char* name;
+  unsigned long long config;
+  int fd;
+} perf_counter;
 
-  // Error checking
-  for (int i = 0; i < v->count; i++) {
-    if (v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
+#ifdef __linux__
+perf_counter perf_counters[] = {
+  { "instructions",  PERF_COUNT_HW_INSTRUCTIONS,        -1 },
+  { "branches",      PERF_COUNT_HW_BRANCH_INSTRUCTIONS, -1 },
+  { "branch-misses", PERF_COUNT_HW_BRANCH_MISSES,       -1 },
+};
+#define PERF_COUNTERS 3
+#else
+perf_counter perf_counters[1];
+#define PERF_COUNTERS 0
+#endif
+
+double perf_start;
+
+void perf_begin(void) {
+#ifdef __linux__
+  for (int i = 0; i < PERF_COUNTERS; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = perf_counters[i].config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    perf_counters[i].fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (perf_counters[i].fd >= 0) {
+      ioctl(perf_counters[i].fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(perf_counters[i].fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
   }
+#endif
+  perf_start = gc_now();
+}
 
-  // Empty and Single expression
-  if (v->count == 0) { return v; }
-  if (v->count == 1) { return lval_take(v, 0); }
+// Read counter i, -1 if it could not be opened
+long long perf_read(int i) {
+  long long n = -1;
+#ifdef __linux__
+  if (perf_counters[i].fd < 0) { return -1; }
+  ioctl(perf_counters[i].fd, PERF_EVENT_IOC_DISABLE, 0);
+  if (read(perf_counters[i].fd, &n, sizeof(n)) != sizeof(n)) { n = -1; }
+  close(perf_counters[i].fd);
+#endif
+  return n;
+}
 
-  // Ensure first element is symbol
-  lval* f = lval_pop(v, 0);
-  if (f->type != LVAL_FUN) {
-    lval* err = lval_err(
-      "S-Expression starts with incorrect type. "
-      "Got %s, Expected %s",
-      ltype_name(f->type), ltype_name(LVAL_FUN));
-    lval_del(f);
-    lval_del(v);
-    return err;
+void perf_stats_print(void) {
+  double t = gc_now() - perf_start;
+  long long n[3] = { -1, -1, -1 };
+  for (int i = 0; i < PERF_COUNTERS; i++) {
+    n[i] = perf_read(i);
   }
 
-  // Call builtin with operator
-  lval* result = lval_call(e, f, v);
-  lval_del(f);
-  return result;
+  fprintf(stderr, "%-14s %14.3f s\n", "time", t);
+  if (n[0] < 0) {
+    fprintf(stderr, "hardware counters not available\n");
+    return;
+  }
+  fprintf(stderr, "%-14s %14lld  %8.1f M/s\n", "instructions", n[0], n[0] / t / 1e6);
+  if (n[1] < 0 || n[2] < 0) { return; }
+  fprintf(stderr, "%-14s %14lld  %8.1f M/s\n", "branches", n[1], n[1] / t / 1e6);
+  fprintf(stderr, "%-14s %14lld  %8.2f %%\n", "branch-misses", n[2],
+    n[1] ? 100.0 * n[2] / n[1] : 0.0);
 }
 
 // ### MAIN ###
 
+// Command line options
+int opt_alloc_stats = 0;
+int opt_gc_stats = 0;
+int opt_perf_stats = 0;
+long opt_nursery_kb = GC_NURSERY_KB;
+
 int main(int argc, char** argv) {
+
+  // Options start with "--", everything else is a file to load
+  int files = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--", 2) != 0) { files++; continue; }
+    if (strcmp(argv[i], "--alloc-stats") == 0) { opt_alloc_stats = 1; continue; }
+    if (strcmp(argv[i], "--gc-stats") == 0) { opt_gc_stats = 1; continue; }
+    if (strcmp(argv[i], "--perf-stats") == 0) { opt_perf_stats = 1; continue; }
+    if (strcmp(argv[i], "--interp=ast") == 0) { lval_interp = INTERP_AST; continue; }
+    if (strcmp(argv[i], "--interp=vm") == 0) { lval_interp = INTERP_VM; continue; }
+    if (strcmp(argv[i], "--optimize=on") == 0) { opt_enabled = 1; continue; }
+    if (strcmp(argv[i], "--optimize=off") == 0) { opt_enabled = 0; continue; }
+    if (strcmp(argv[i], "--dump-optimized") == 0) { opt_dump = 1; continue; }
+#if TYSON_JIT
+    if (strcmp(argv[i], "--jit=on") == 0) { jit_enabled = 1; continue; }
+    if (strcmp(argv[i], "--jit=off") == 0) { jit_enabled = 0; continue; }
+#endif
+    if (strncmp(argv[i], "--nursery=", 10) == 0) {
+      opt_nursery_kb = strtol(argv[i] + 10, NULL, 10);
+      if (opt_nursery_kb > 0) { continue; }
+    }
+    fprintf(stderr, "Unknown option '%s'\n", argv[i]);
+    return 1;
+  }
   
   // Creating Parsers
   Number  = mpc_new("number");
@@ -1096,11 +3844,22 @@ int main(int argc, char** argv) {
     ",
     Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Tyson);
   
+  gc_init(opt_nursery_kb);
+  sym_amp = sym_intern("&");
+  sym_if = sym_intern("if");
+  sym_lambda = sym_intern("\\");
+  sym_put = sym_intern("=");
+  sym_def = sym_intern("def");
+  sym_fun = sym_intern("fun");
+  sym_defmacro = sym_intern("defmacro");
+
   lenv* e = lenv_new();
+  lenv_root = e;
   lenv_add_builtins(e);
+  gc_push_env(e);
   
   // Interactive Prompt
-  if (argc == 1) {
+  if (files == 0) {
   
     puts("Tyson Version 1.0");
     puts("Press Ctrl+c to Exit\n");
@@ -1114,9 +3873,10 @@ int main(int argc, char** argv) {
       mpc_result_t r;
       if (mpc_parse("<stdin>", input, Tyson, &r)) {
         
-        lval* x = lval_eval(e, lval_read(r.output));
+        lval* x = lval_expand(lval_read(r.output));
+        lval_share(x);
+        x = lval_eval(e, x);
         lval_println(x);
-        lval_del(x);
         
         mpc_ast_delete(r.output);
       } else {    
@@ -1131,10 +3891,13 @@ int main(int argc, char** argv) {
   }
   
   // When called with filenames
-  if (argc >= 2) {
+  if (files > 0) {
+
+    if (opt_perf_stats) { perf_begin(); }
   
     // For each filename
     for (int i = 1; i < argc; i++) {
+      if (strncmp(argv[i], "--", 2) == 0) { continue; }
       
       // Arg list with single argument, the filenames
       lval* args = lval_add(lval_sexpr(), lval_str(argv[i]));
@@ -1143,12 +3906,16 @@ int main(int argc, char** argv) {
       lval* x = builtin_load(e, args);
       
       // If result is an Error print it
-      if (x->type == LVAL_ERR) { lval_println(x); }
-      lval_del(x);
+      if (lval_type(x) == LVAL_ERR) { lval_println(x); }
     }
+
+    if (opt_perf_stats) { perf_stats_print(); }
   }
   
   lenv_del(e);
+
+  if (opt_alloc_stats) { alloc_stats_print(); }
+  if (opt_gc_stats) { gc_stats_print(); }
   
   // Undefine and delete parsers
   mpc_cleanup(8, 